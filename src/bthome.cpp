@@ -1,3 +1,4 @@
+
 #include "bthome.h"
 #include "powerwall.h"
 
@@ -8,48 +9,53 @@
 
 static const uint16_t BTHOME_SERVICE_UUID_16 = 0xFCD2;
 static const uint8_t BTHOME_INFO_UNENCRYPTED_V2 = 0x40;
-static const uint8_t BTHOME_OBJ_MEASUREMENT_ID = 0x00; // u8 index for following measurements
-static const uint8_t BTHOME_OBJ_BATTERY = 0x01; // uint8
-static const uint8_t BTHOME_OBJ_POWER = 0x0B;   // s24 W (legacy)
-static const uint8_t BTHOME_OBJ_POWER_32 = 0x5C; // s32, factor 0.01 W (preferred)
-static const uint8_t BTHOME_OBJ_BOOLEAN = 0x0F;  // uint8 (0/1)
+static const uint8_t BTHOME_INFO_ENCRYPTED_V2 = 0x41;
 
 BTHomeAdvertiser::BTHomeAdvertiser()
-  : started(false), advertising(nullptr), deviceName(""), frameIndex(0), hasData(false),
-    lastAdvMs(0), advIntervalMs(1000),
-    cachedBatteryPercent(0), cachedSolarW(0), cachedLoadW(0), cachedBatteryW(0), cachedSiteW(0), cachedGrid(false) {}
+  : started(false), connectable(false), payloadConfigured(false), advertising(nullptr), deviceName(""), frameIndex(0), frameCount(0),
+    advFrames{{0}}, advLen{0}, rspFrames{{0}}, rspLen{0}, scheduleDirty(false), hasData(false),
+    lastAdvMs(0), advIntervalMs(1000), intervalMs(0), burstStartMs(0), burstPacketId(0),
+    cachedBatteryPercent(0), cachedSolarW(0), cachedLoadW(0), cachedBatteryW(0), cachedSiteW(0), cachedGrid(false),
+    hasDetails(false), cachedEnergyWh(0), cachedVoltage{}, cachedVoltageCount(0), cachedAlerts(0),
+    cachedBlockPercent{0}, cachedBlockCount(0), gatewayOnline(true), packetId(0) {}
 
-void BTHomeAdvertiser::begin(const String &deviceNameArg) {
+void BTHomeAdvertiser::begin(const String &deviceNameArg, const char *bindKeyHex) {
   if (started) return;
   deviceName = deviceNameArg;
   NimBLEDevice::init(deviceName.c_str());
+  if (bindKeyHex) {
+    // The nonce takes the advertising address in display order; NimBLE stores it reversed
+    const uint8_t *native = NimBLEDevice::getAddress().getNative();
+    uint8_t mac[6];
+    for (uint8_t i = 0; i < 6; i++) mac[i] = native[5 - i];
+    if (!cipher.begin(bindKeyHex, mac)) {
+      Serial.println("[BTHome] Encryption unavailable; advertiser disabled");
+      return;
+    }
+  }
   // Increase TX power for visibility
   NimBLEDevice::setPower(ESP_PWR_LVL_P7);
   advertising = NimBLEDevice::getAdvertising();
   started = true;
   lastAdvMs = millis();
-  Serial.println("[BTHome] Advertiser initialized; waiting for first data update");
+  Serial.printf("[BTHome] Advertiser initialized (%s); waiting for first data update\n", cipher.enabled() ? "encrypted" : "unencrypted");
 }
 
-static inline void append_u8(std::string &buf, uint8_t v) { buf.push_back((char)v); }
-static inline void append_s24(std::string &buf, int32_t v) {
-  if (v > 8388607) v = 8388607;
-  if (v < -8388608) v = -8388608;
-  uint32_t uv = (uint32_t)(v & 0x00FFFFFF);
-  buf.push_back((char)(uv & 0xFF));
-  buf.push_back((char)((uv >> 8) & 0xFF));
-  buf.push_back((char)((uv >> 16) & 0xFF));
+void BTHomeAdvertiser::benchmarkCipher(Print &out) {
+  BTHomeCipher::benchmark(out, SealedPinnedFields::size, 200);
 }
-static inline void append_s32(std::string &buf, int32_t v) {
-  buf.push_back((char)(v & 0xFF));
-  buf.push_back((char)((v >> 8) & 0xFF));
-  buf.push_back((char)((v >> 16) & 0xFF));
-  buf.push_back((char)((v >> 24) & 0xFF));
+
+static uint8_t objectBytes(const BTHomeObject *objects, uint8_t count) {
+  uint8_t bytes = 0;
+  for (uint8_t i = 0; i < count; i++) bytes += 1 + objects[i].len;
+  return bytes;
 }
 
 void BTHomeAdvertiser::updateBatteryAndPowers(uint8_t batteryPercent, int32_t solarPowerW, int32_t loadPowerW, int32_t batteryPowerW, int32_t sitePowerW, bool gridConnected) {
   if (!started) return;
   if (batteryPercent > 100) batteryPercent = 100;
+  if (hasData && batteryPercent == cachedBatteryPercent && solarPowerW == cachedSolarW && loadPowerW == cachedLoadW &&
+      batteryPowerW == cachedBatteryW && sitePowerW == cachedSiteW && gridConnected == cachedGrid) return;
   cachedBatteryPercent = batteryPercent;
   cachedSolarW = solarPowerW;
   cachedLoadW = loadPowerW;
@@ -57,66 +63,339 @@ void BTHomeAdvertiser::updateBatteryAndPowers(uint8_t batteryPercent, int32_t so
   cachedSiteW = sitePowerW;
   cachedGrid = gridConnected;
   hasData = true;
-  // Increment packet id on new data
+  scheduleDirty = true;
+}
+
+void BTHomeAdvertiser::updateDetails(float energyRemainingWh, const float *voltagesV, uint8_t voltageCount, uint8_t alertCount) {
+  if (!started) return;
+  if (voltageCount > MAX_VOLTAGES) voltageCount = MAX_VOLTAGES;
+  uint32_t energyWh = energyRemainingWh > 0 ? (uint32_t)energyRemainingWh : 0;
+  // Phases the site does not have are reported as 0 and left out
+  BTHomeObject voltages[MAX_VOLTAGES];
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < voltageCount; i++) {
+    if (voltagesV[i] > 0) voltages[count++] = BTHomeVoltage::make(voltagesV[i]);
+  }
+  bool changed = !hasDetails || energyWh != cachedEnergyWh || alertCount != cachedAlerts || count != cachedVoltageCount ||
+                 memcmp(voltages, cachedVoltage, sizeof(BTHomeObject) * count) != 0;
+  memcpy(cachedVoltage, voltages, sizeof(BTHomeObject) * count);
+  cachedEnergyWh = energyWh;
+  cachedVoltageCount = count;
+  cachedAlerts = alertCount;
+  hasDetails = true;
+  if (changed) scheduleDirty = true;
+}
+
+void BTHomeAdvertiser::updateBlocks(const uint8_t *blockPercents, uint8_t count) {
+  if (!started) return;
+  if (count > MAX_BATTERY_BLOCKS) count = MAX_BATTERY_BLOCKS;
+  bool changed = count != cachedBlockCount;
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t pct = blockPercents[i] > 100 ? 100 : blockPercents[i];
+    changed |= pct != cachedBlockPercent[i];
+    cachedBlockPercent[i] = pct;
+  }
+  cachedBlockCount = count;
+  if (changed) scheduleDirty = true;
+}
+
+void BTHomeAdvertiser::updateLink(bool online) {
+  if (online == gatewayOnline) return;
+  gatewayOnline = online;
+  scheduleDirty = true;
+}
+
+uint8_t BTHomeAdvertiser::collectPinned(BTHomeObject *out) const {
+  // Stale powers are not re-advertised while the gateway link is degraded
+  if (!gatewayOnline) return OfflineFields::encode(out, cachedBatteryPercent, false);
+  // Always include all four powers in the same order so HA maps power_1..power_4 consistently
+  if (cipher.enabled() && connectable && !BTHOME_EXTENDED_ADV) {
+    return SealedConnectablePinnedFields::encode(out, cachedSolarW, cachedLoadW, cachedSiteW);
+  }
+  if (cipher.enabled()) return SealedPinnedFields::encode(out, cachedSolarW, cachedLoadW, cachedSiteW, cachedBatteryW);
+  if (connectable && !BTHOME_EXTENDED_ADV) {
+    return ConnectablePinnedFields::encode(out, cachedBatteryPercent, cachedSolarW, cachedLoadW, cachedSiteW, cachedBatteryW);
+  }
+  return PinnedFields::encode(out, cachedBatteryPercent, cachedSolarW, cachedLoadW, cachedSiteW, cachedBatteryW);
+}
+
+uint8_t BTHomeAdvertiser::collectGroup(Group group, BTHomeObject *out) const {
+  uint8_t n = 0;
+  bool live = gatewayOnline;
+  switch (group) {
+    case GROUP_POWER:
+      // Battery power left the encrypted connectable advertisement; the four powers travel together
+      if (live && cipher.enabled() && connectable && !BTHOME_EXTENDED_ADV) {
+        n = SealedPinnedFields::encode(out, cachedSolarW, cachedLoadW, cachedSiteW, cachedBatteryW);
+      }
+      break;
+    case GROUP_SOC:
+      if (live && cipher.enabled()) n = BTHomeFields<BTHomeBattery>::encode(out, cachedBatteryPercent);
+      break;
+    case GROUP_GRID:
+      if (live) n = BTHomeFields<BTHomePowerOn>::encode(out, cachedGrid);
+      break;
+    case GROUP_CONNECTIVITY:
+      if (live) n = BTHomeFields<BTHomeConnectivity>::encode(out, true);
+      break;
+    case GROUP_ALERTS:
+      if (live && hasDetails) n = BTHomeFields<BTHomeCount>::encode(out, cachedAlerts);
+      break;
+    case GROUP_ENERGY:
+      if (live && hasDetails) n = BTHomeFields<BTHomeEnergy>::encode(out, cachedEnergyWh);
+      break;
+    case GROUP_BLOCKS:
+      // Aggregate battery leads so HA keeps battery_1 as the site total; blocks follow as battery_2..N
+      if (cachedBlockCount == 0) break;
+      n = BTHomeFields<BTHomeBattery>::encode(out, cachedBatteryPercent);
+      n += BlockFields::encode(out + n, cachedBlockPercent, cachedBlockCount);
+      break;
+    case GROUP_VOLTAGE:
+      if (!live) break;
+      memcpy(out, cachedVoltage, sizeof(BTHomeObject) * cachedVoltageCount);
+      n = cachedVoltageCount;
+      break;
+    default:
+      break;
+  }
+  return n;
+}
+
+uint8_t BTHomeAdvertiser::encodePacket(uint8_t *buf, BTHomeObject *objects, uint8_t count) {
+  // Objects go out in ascending id order; the insertion sort is stable so repeated ids keep their order
+  for (uint8_t i = 1; i < count; i++) {
+    BTHomeObject o = objects[i];
+    uint8_t j = i;
+    while (j > 0 && objects[j - 1].id > o.id) { objects[j] = objects[j - 1]; j--; }
+    objects[j] = o;
+  }
+  uint8_t plain[ADV_MAX];
+  uint8_t n = 0;
   packetId++;
+  if (!cipher.enabled()) {
+    plain[n++] = BTHomePacketId::id;
+    plain[n++] = packetId;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    plain[n++] = objects[i].id;
+    memcpy(&plain[n], objects[i].value, objects[i].len);
+    n += objects[i].len;
+  }
+  uint8_t len = 0;
+  buf[len++] = 0;    // service data length, set below
+  buf[len++] = 0x16; // service data - 16-bit UUID
+  buf[len++] = BTHOME_SERVICE_UUID_16 & 0xFF;
+  buf[len++] = BTHOME_SERVICE_UUID_16 >> 8;
+  if (cipher.enabled()) {
+    buf[len++] = BTHOME_INFO_ENCRYPTED_V2;
+    len += cipher.seal(BTHOME_INFO_ENCRYPTED_V2, plain, n, &buf[len]);
+  } else {
+    buf[len++] = BTHOME_INFO_UNENCRYPTED_V2;
+    memcpy(&buf[len], plain, n);
+    len += n;
+  }
+  buf[0] = len - 1;
+  return len;
 }
 
-void BTHomeAdvertiser::startAdvertising() {
-  if (!advertising) return;
-  advertising->stop();
-  // Use scannable non-connectable advertising so scanners can read scan response
-  advertising->setAdvertisementType(BLE_HCI_ADV_TYPE_ADV_SCAN_IND);
-  advertising->setMinInterval(0x00A0); // 100ms
-  advertising->setMaxInterval(0x00F0); // 150ms
-  advertising->setScanResponse(true);
-  advertising->start();
+static uint8_t writeName(uint8_t *buf, const String &name, uint8_t maxLen) {
+  uint8_t nameLen = (uint8_t)min<size_t>(name.length(), maxLen);
+  if (!nameLen) return 0;
+  buf[0] = nameLen + 1;
+  buf[1] = 0x09; // complete local name
+  memcpy(&buf[2], name.c_str(), nameLen);
+  return nameLen + 2;
 }
 
-void BTHomeAdvertiser::tick() {
-  if (!started || !advertising || !hasData) return;
-  unsigned long now = millis();
-  if (now - lastAdvMs < advIntervalMs) return;
-  lastAdvMs = now;
-  buildAdvertisement(cachedBatteryPercent, cachedSolarW, cachedLoadW, cachedBatteryW, cachedSiteW, cachedGrid);
-  startAdvertising();
-}
-
-void BTHomeAdvertiser::buildAdvertisement(uint8_t batteryPercent, int32_t solarPowerW, int32_t loadPowerW, int32_t batteryPowerW, int32_t sitePowerW, bool gridConnected) {
-  // Compact consistent frame: battery% (0x01) + four powers (0x5C): solar, load, site, battery
-  std::string serviceData;
-  serviceData.reserve(30);
-  append_u8(serviceData, BTHOME_INFO_UNENCRYPTED_V2);
-
-  // Battery percent (keep first, ascending ID)
-  append_u8(serviceData, BTHOME_OBJ_BATTERY);
-  append_u8(serviceData, batteryPercent);
-
-  auto append_power_s32_value = [&](int32_t watts) {
-    int64_t scaled = (int64_t)watts * 100LL; // factor 0.01 W
-    if (scaled > INT32_MAX) scaled = INT32_MAX;
-    if (scaled < INT32_MIN) scaled = INT32_MIN;
-    append_u8(serviceData, BTHOME_OBJ_POWER_32);
-    append_s32(serviceData, (int32_t)scaled);
+static uint8_t writeFlags(uint8_t *buf) {
+  buf[0] = 2;
+  buf[1] = 0x01; // flags
+  buf[2] = 0x06; // LE General Discoverable, BR/EDR not supported
+  return 3;
+}
+
+void BTHomeAdvertiser::rebuildSchedule() {
+  const uint8_t overhead = packetOverhead();
+  BTHomeObject pinned[MAX_OBJECTS];
+  uint8_t pinnedCount = collectPinned(pinned);
+  BTHomeObject groups[GROUP_COUNT][MAX_OBJECTS];
+  uint8_t groupCount[GROUP_COUNT];
+  for (uint8_t g = 0; g < GROUP_COUNT; g++) groupCount[g] = collectGroup((Group)g, groups[g]);
+
+  // Adds every pending group that fits; the block group drops its leading aggregate battery
+  // when the packet already carries one
+  auto fill = [&](BTHomeObject *objects, uint8_t &count, uint8_t room) {
+    bool placed = false;
+    for (uint8_t g = 0; g < GROUP_COUNT; g++) {
+      if (groupCount[g] == 0) continue;
+      bool hasBattery = false;
+      for (uint8_t i = 0; i < count; i++) hasBattery |= objects[i].id == BTHomeBattery::id;
+      uint8_t skip = (g == GROUP_BLOCKS && hasBattery) ? 1 : 0;
+      uint8_t n = groupCount[g] - skip;
+      uint8_t bytes = objectBytes(&groups[g][skip], n);
+      if (bytes > room || count + n > MAX_OBJECTS) continue;
+      memcpy(&objects[count], &groups[g][skip], sizeof(BTHomeObject) * n);
+      count += n;
+      room -= bytes;
+      groupCount[g] = 0;
+      placed = true;
+    }
+    return placed;
   };
 
-  // Always include all four powers in the same order so HA maps power_1..power_4 consistently
-  append_power_s32_value(solarPowerW);
-  append_power_s32_value(loadPowerW);
-  append_power_s32_value(sitePowerW);
-  append_power_s32_value(batteryPowerW);
+  frameCount = 0;
+  bool pending;
+  do {
+    uint8_t *adv = advFrames[frameCount];
+    uint8_t advOffset = sendsFlags() ? writeFlags(adv) : 0;
+#if BTHOME_EXTENDED_ADV
+    // Extended PDUs are not scannable, so the name rides in the advertisement
+    advOffset += writeName(&adv[advOffset], deviceName, DEVICE_NAME_MAX);
+#endif
+    // Advertisement: pinned objects plus whatever rotating groups still fit
+    BTHomeObject objects[MAX_OBJECTS];
+    uint8_t count = pinnedCount;
+    memcpy(objects, pinned, sizeof(BTHomeObject) * pinnedCount);
+    bool placed = fill(objects, count, ADV_MAX - advOffset - overhead - objectBytes(objects, count));
+    advLen[frameCount] = advOffset + encodePacket(&adv[advOffset], objects, count);
 
-  // Prepare advertisement
-  NimBLEAdvertisementData advData;
-  advData.setFlags(ESP_BLE_ADV_FLAG_GEN_DISC | ESP_BLE_ADV_FLAG_BREDR_NOT_SPT);
-  advData.setServiceData(NimBLEUUID(BTHOME_SERVICE_UUID_16), serviceData);
+    // Scan response: device name plus a second packet with the next groups that fit
+    uint8_t *rsp = rspFrames[frameCount];
+    uint8_t len = 0;
+#if !BTHOME_EXTENDED_ADV
+    // An encrypted packet leaves no room for the name
+    if (!cipher.enabled()) len = writeName(rsp, deviceName, DEVICE_NAME_MAX);
+    count = 0;
+    placed |= fill(objects, count, RSP_MAX - len - overhead);
+    if (count) len += encodePacket(&rsp[len], objects, count);
+#endif
+    rspLen[frameCount] = len;
+    frameCount++;
+
+    pending = false;
+    for (uint8_t g = 0; g < GROUP_COUNT; g++) pending |= groupCount[g] > 0;
+    if (!placed) break; // remaining groups never fit a frame
+  } while (pending && frameCount < MAX_FRAMES);
+  scheduleDirty = false;
+}
+
+#if BTHOME_EXTENDED_ADV
+bool BTHomeAdvertiser::isAdvertising() {
+  return advertising->isActive(0);
+}
+
+void BTHomeAdvertiser::startAdvertising() {
+  burstPacketId = packetId;
+  burstStartMs = millis();
+  intervalMs = 0;
+  setInterval(BTHOME_BURST_INTERVAL_MS);
+}
+
+void BTHomeAdvertiser::setInterval(uint16_t ms) {
+  if (ms == intervalMs && advertising->isActive(0)) return;
+  // Instance parameters can only be configured while the instance is stopped. The instance
+  // description is kept so its payload buffer is reused rather than reallocated.
+  advertising->stop(0);
+  extAdv.setLegacyAdvertising(false);
+  extAdv.setConnectable(connectable);
+  extAdv.setScannable(false);
+  extAdv.setData(advFrames[frameIndex], advLen[frameIndex]);
+  uint32_t units = (uint32_t)ms * 8 / 5; // 0.625 ms units
+  extAdv.setMinInterval(units);
+  extAdv.setMaxInterval(units + units / 4);
+  if (!advertising->setInstanceData(0, extAdv) || !advertising->start(0)) {
+    Serial.println("[BTHome] Extended advertising start failed");
+  }
+  intervalMs = ms;
+  advIntervalMs = (unsigned long)ms * BTHOME_FRAME_DWELL_EVENTS;
+}
+
+void BTHomeAdvertiser::showFrame(uint8_t index) {
+  frameIndex = index;
+  // The host takes ownership of the mbuf on success and on failure
+  struct os_mbuf *buf = os_msys_get_pkthdr(advLen[index], 0);
+  if (!buf) { Serial.println("[BTHome] Advertisement update failed (no mbuf)"); return; }
+  if (os_mbuf_append(buf, advFrames[index], advLen[index]) != 0) {
+    os_mbuf_free_chain(buf);
+    Serial.println("[BTHome] Advertisement update failed (append)");
+    return;
+  }
+  int rc = ble_gap_ext_adv_set_data(0, buf);
+  if (rc != 0) Serial.printf("[BTHome] Advertisement update failed (rc=%d)\n", rc);
+}
+#else
+bool BTHomeAdvertiser::isAdvertising() {
+  return advertising->isAdvertising();
+}
 
-  NimBLEAdvertisementData scanResp;
-  if (deviceName.length()) {
-    scanResp.setName(deviceName.c_str());
+void BTHomeAdvertiser::startAdvertising() {
+  // Configured once; later payload changes, and restarts after a GATT connection, swap raw
+  // frames into the host without building NimBLEAdvertisementData (heap) again
+  if (payloadConfigured) {
+    showFrame(frameIndex);
+  } else {
+    NimBLEAdvertisementData advData;
+    advData.addData((char *)advFrames[frameIndex], advLen[frameIndex]);
+    NimBLEAdvertisementData scanResp;
+    scanResp.addData((char *)rspFrames[frameIndex], rspLen[frameIndex]);
+    // Raw frames: NimBLE adds no flags AD, the connectable frames carry their own
+    advertising->setAdvertisementType(connectable ? BLE_HCI_ADV_TYPE_ADV_IND : BLE_HCI_ADV_TYPE_ADV_SCAN_IND);
+    advertising->setScanResponse(true);
+    advertising->setAdvertisementData(advData);
+    advertising->setScanResponseData(scanResp);
+    payloadConfigured = true;
   }
+  burstPacketId = packetId;
+  burstStartMs = millis();
+  intervalMs = 0;
+  setInterval(BTHOME_BURST_INTERVAL_MS);
+}
 
-  advertising->setAdvertisementData(advData);
-  advertising->setScanResponseData(scanResp);
+void BTHomeAdvertiser::setInterval(uint16_t ms) {
+  if (ms == intervalMs && advertising->isAdvertising()) return;
+  // Interval parameters only apply at start; the payload set on the controller is kept
+  advertising->stop();
+  uint16_t units = (uint16_t)((uint32_t)ms * 8 / 5); // 0.625 ms units
+  advertising->setMinInterval(units);
+  advertising->setMaxInterval(units + units / 4);
+  advertising->start();
+  intervalMs = ms;
+  advIntervalMs = (unsigned long)ms * BTHOME_FRAME_DWELL_EVENTS;
 }
 
+void BTHomeAdvertiser::showFrame(uint8_t index) {
+  frameIndex = index;
+  int rc = ble_gap_adv_set_data(advFrames[index], advLen[index]);
+  if (rc == 0) rc = ble_gap_adv_rsp_set_data(rspFrames[index], rspLen[index]);
+  if (rc != 0) Serial.printf("[BTHome] Advertisement update failed (rc=%d)\n", rc);
+}
+#endif
 
+void BTHomeAdvertiser::tick() {
+  if (!started || !advertising || !hasData) return;
+  unsigned long now = millis();
+  if (scheduleDirty) {
+    rebuildSchedule();
+    frameIndex = 0;
+  }
+  if (!isAdvertising()) {
+    startAdvertising();
+    lastAdvMs = now;
+    return;
+  }
+  if (packetId != burstPacketId) {
+    // New values: put the first frame on air right away and burst
+    burstPacketId = packetId;
+    burstStartMs = now;
+    lastAdvMs = now;
+    showFrame(0);
+    setInterval(BTHOME_BURST_INTERVAL_MS);
+    return;
+  }
+  if (intervalMs != BTHOME_IDLE_INTERVAL_MS && now - burstStartMs >= BTHOME_BURST_DURATION_MS) {
+    setInterval(BTHOME_IDLE_INTERVAL_MS);
+  }
+  if (now - lastAdvMs < advIntervalMs) return;
+  lastAdvMs = now;
+  if (frameCount > 1) showFrame((uint8_t)((frameIndex + 1) % frameCount));
+}
@@ -4,28 +4,143 @@
 #include <Arduino.h>
 #include <NimBLEDevice.h>
 #include "powerwall.h"
+#include "bthome_objects.h"
+#include "bthome_crypto.h"
 
-// Simple BTHome v2 unencrypted advertiser for Home Assistant discovery.
-// Note: We start with battery percent only; additional fields can be added later.
+// Advertising interval policy: after each data change advertise at the burst interval for
+// BTHOME_BURST_DURATION_MS so scanners pick up the new values quickly, then fall back to the
+// idle interval. Each frame stays on air for BTHOME_FRAME_DWELL_EVENTS advertising events.
+#ifndef BTHOME_BURST_INTERVAL_MS
+#define BTHOME_BURST_INTERVAL_MS 30
+#endif
+#ifndef BTHOME_BURST_DURATION_MS
+#define BTHOME_BURST_DURATION_MS 3000
+#endif
+#ifndef BTHOME_IDLE_INTERVAL_MS
+#define BTHOME_IDLE_INTERVAL_MS 1000
+#endif
+#ifndef BTHOME_FRAME_DWELL_EVENTS
+#define BTHOME_FRAME_DWELL_EVENTS 4
+#endif
+
+// BLE 5 extended advertising (ESP32-S3/C3): the full record goes out as one non-scannable
+// extended PDU instead of rotating legacy frames. Needs -DCONFIG_BT_NIMBLE_EXT_ADV=1 as well.
+#ifndef BTHOME_EXTENDED_ADV
+#define BTHOME_EXTENDED_ADV 0
+#endif
+#if BTHOME_EXTENDED_ADV && !defined(CONFIG_BT_NIMBLE_EXT_ADV)
+#error "BTHOME_EXTENDED_ADV requires CONFIG_BT_NIMBLE_EXT_ADV=1"
+#endif
+
+// BTHome v2 advertiser for Home Assistant discovery, unencrypted or AES-CCM with a bind key.
+// Every frame carries battery percent and the four powers; grid state, connectivity, alert count,
+// energy remaining, per-block batteries and mains voltages rotate through the remaining space of
+// the advertisement and the scan response. While the gateway link is degraded only battery
+// levels and connectivity are sent. Encrypted legacy frames pin only the powers; battery percent
+// joins the rotation and the name is left out. With BTHOME_EXTENDED_ADV everything fits one frame.
+// Connectable advertisements lead with the Flags AD. To make room in legacy frames, solar and load
+// use the 3-byte power object; encrypted ones pin only solar, load and site, and all four powers
+// rotate through the scan response in their usual order.
+// The frame schedule is encoded into fixed buffers when values change and swapped into the
+// running advertisement, so the controller keeps advertising between updates.
 
 class BTHomeAdvertiser {
 public:
   BTHomeAdvertiser();
-  void begin(const String &deviceNameArg);
+  void begin(const String &deviceNameArg, const char *bindKeyHex = nullptr);
   void updateBatteryAndPowers(uint8_t batteryPercent, int32_t solarPowerW, int32_t loadPowerW, int32_t batteryPowerW, int32_t sitePowerW, bool gridConnected);
+  void updateDetails(float energyRemainingWh, const float *voltagesV, uint8_t voltageCount, uint8_t alertCount);
+  void updateBlocks(const uint8_t *blockPercents, uint8_t count);
+  void updateLink(bool gatewayOnline);
+  // Connectable advertising for a GATT server on the same radio; call before the first tick()
+  void setConnectable(bool enabled) { connectable = enabled; }
+  // Times AES-CCM sealing of a full encrypted pinned packet
+  void benchmarkCipher(Print &out);
   void tick();
 
 private:
+#if BTHOME_EXTENDED_ADV
+  static const uint8_t ADV_MAX = BTHOME_EXT_ADV_MAX;
+  static const uint8_t MAX_FRAMES = 1;
+#else
+  static const uint8_t ADV_MAX = BTHOME_LEGACY_ADV_MAX;
+  static const uint8_t MAX_FRAMES = 4;
+#endif
+  static const uint8_t RSP_MAX = BTHOME_LEGACY_ADV_MAX;
+  static const uint8_t MAX_OBJECTS = 20;
+  static const uint8_t MAX_VOLTAGES = 3;
+
+  typedef BTHomeFields<BTHomeBattery, BTHomePower, BTHomePower, BTHomePower, BTHomePower> PinnedFields;
+  // Solar and load are never negative, so the 3-byte unsigned power object leaves room for the MIC
+  typedef BTHomeFields<BTHomePowerU24, BTHomePowerU24, BTHomePower, BTHomePower> SealedPinnedFields;
+  typedef BTHomeFields<BTHomeBattery, BTHomePowerU24, BTHomePowerU24, BTHomePower, BTHomePower> ConnectablePinnedFields;
+  typedef BTHomeFields<BTHomePowerU24, BTHomePowerU24, BTHomePower> SealedConnectablePinnedFields;
+  // LE General Discoverable, BR/EDR not supported
+  static const uint8_t FLAGS_AD_SIZE = 3;
+  typedef BTHomeFields<BTHomeBattery, BTHomeConnectivity> OfflineFields;
+  typedef BTHomeRepeated<BTHomeBattery, MAX_BATTERY_BLOCKS> BlockFields;
+  typedef BTHomeRepeated<BTHomeVoltage, MAX_VOLTAGES> VoltageFields;
+  typedef BTHomeFields<BTHomePowerOn, BTHomeConnectivity, BTHomeCount, BTHomeEnergy> DetailFields;
+  // Blocks travel behind a copy of the aggregate battery and are the largest rotating group
+  static const uint16_t LARGEST_GROUP = BTHomeBattery::size + BlockFields::size > VoltageFields::size
+                                          ? BTHomeBattery::size + BlockFields::size : VoltageFields::size;
+  // The device name is cut so any rotating group still fits next to it in the scan response
+  static const uint8_t DEVICE_NAME_MAX = RSP_MAX - BTHOME_PACKET_OVERHEAD - 2 - LARGEST_GROUP;
+  // Encrypted packets carry counter and MIC instead of the packet id
+  static const uint8_t SEALED_OVERHEAD = BTHOME_PACKET_OVERHEAD - BTHomePacketId::size + BTHOME_CRYPTO_OVERHEAD;
+
+  static_assert(BTHOME_PACKET_OVERHEAD + PinnedFields::size <= ADV_MAX, "pinned objects exceed the advertisement");
+  static_assert(RSP_MAX > BTHOME_PACKET_OVERHEAD + 2 + LARGEST_GROUP, "rotating group exceeds the scan response");
+  static_assert(SEALED_OVERHEAD + SealedPinnedFields::size <= ADV_MAX, "encrypted pinned objects exceed the advertisement");
+  static_assert(FLAGS_AD_SIZE + BTHOME_PACKET_OVERHEAD + ConnectablePinnedFields::size <= ADV_MAX,
+                "connectable pinned objects exceed the advertisement");
+  static_assert(FLAGS_AD_SIZE + SEALED_OVERHEAD + SealedConnectablePinnedFields::size <= ADV_MAX,
+                "encrypted connectable pinned objects exceed the advertisement");
+  static_assert(SEALED_OVERHEAD + SealedPinnedFields::size <= RSP_MAX, "encrypted power group exceeds the scan response");
+  static_assert(SEALED_OVERHEAD + LARGEST_GROUP <= RSP_MAX, "encrypted rotating group exceeds the scan response");
+#if BTHOME_EXTENDED_ADV
+  static_assert(FLAGS_AD_SIZE + 2 + DEVICE_NAME_MAX + SEALED_OVERHEAD + BTHomeBattery::size + PinnedFields::size + DetailFields::size +
+                BlockFields::size + VoltageFields::size <= ADV_MAX, "full record exceeds the extended advertisement");
+#endif
+  // Rotating objects in priority order; objects of one group always travel together so
+  // repeated types (battery, voltage) keep their per-packet index in Home Assistant
+  enum Group : uint8_t { GROUP_POWER, GROUP_SOC, GROUP_GRID, GROUP_CONNECTIVITY, GROUP_ALERTS, GROUP_ENERGY, GROUP_BLOCKS, GROUP_VOLTAGE, GROUP_COUNT };
+
+  bool isAdvertising();
   void startAdvertising();
-  void buildAdvertisement(uint8_t batteryPercent, int32_t solarPowerW, int32_t loadPowerW, int32_t batteryPowerW, int32_t sitePowerW, bool gridConnected);
+  void setInterval(uint16_t intervalMs);
+  uint8_t packetOverhead() const { return cipher.enabled() ? SEALED_OVERHEAD : BTHOME_PACKET_OVERHEAD; }
+  bool sendsFlags() const { return connectable; }
+  void rebuildSchedule();
+  uint8_t collectPinned(BTHomeObject *out) const;
+  uint8_t collectGroup(Group group, BTHomeObject *out) const;
+  uint8_t encodePacket(uint8_t *buf, BTHomeObject *objects, uint8_t count);
+  void showFrame(uint8_t index);
 
   bool started;
+  bool connectable;
+  bool payloadConfigured;
+  BTHomeCipher cipher;
+#if BTHOME_EXTENDED_ADV
+  NimBLEExtAdvertising *advertising;
+  NimBLEExtAdvertisement extAdv;
+#else
   NimBLEAdvertising *advertising;
+#endif
   String deviceName;
-  uint8_t frameIndex; // 0, 1 for 2-frame round-robin
+  uint8_t frameIndex;
+  uint8_t frameCount;
+  uint8_t advFrames[MAX_FRAMES][ADV_MAX];
+  uint8_t advLen[MAX_FRAMES];
+  uint8_t rspFrames[MAX_FRAMES][RSP_MAX];
+  uint8_t rspLen[MAX_FRAMES];
+  bool scheduleDirty; // cached values changed since the schedule was encoded
   bool hasData;
   unsigned long lastAdvMs;
-  unsigned long advIntervalMs;
+  unsigned long advIntervalMs; // frame dwell at the current advertising interval
+  uint16_t intervalMs;
+  unsigned long burstStartMs;
+  uint8_t burstPacketId;
   // Cached values for round-robin advertising
   uint8_t cachedBatteryPercent;
   int32_t cachedSolarW;
@@ -33,10 +148,16 @@ private:
   int32_t cachedBatteryW;
   int32_t cachedSiteW;
   bool cachedGrid;
-  // BTHome packet id (0x00) to assist deduplication
+  bool hasDetails;
+  uint32_t cachedEnergyWh;
+  BTHomeObject cachedVoltage[MAX_VOLTAGES];
+  uint8_t cachedVoltageCount;
+  uint8_t cachedAlerts;
+  uint8_t cachedBlockPercent[MAX_BATTERY_BLOCKS];
+  uint8_t cachedBlockCount;
+  bool gatewayOnline;
+  // BTHome packet id (0x00), advanced for every encoded packet so receivers drop only true repeats
   uint8_t packetId;
 };
 
 #endif // BTHOME_H
-
-
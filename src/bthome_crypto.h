@@ -0,0 +1,35 @@
+#ifndef BTHOME_CRYPTO_H
+#define BTHOME_CRYPTO_H
+
+#include <Arduino.h>
+#include <mbedtls/ccm.h>
+
+// Counter and MIC appended after the ciphertext of an encrypted BTHome packet
+static const uint8_t BTHOME_CRYPTO_OVERHEAD = 8;
+
+// BTHome v2 AES-CCM sealing. The key schedule is set up once in begin(); mbedTLS runs it on the
+// ESP32 AES accelerator. Nonce: MAC (display order) | UUID 0xFCD2 | info byte | counter (LE).
+class BTHomeCipher {
+public:
+  BTHomeCipher();
+  ~BTHomeCipher();
+
+  bool begin(const char* keyHex, const uint8_t mac[6]);
+  bool enabled() const { return ready; }
+  // Fixed key and starting counter; begin() is the entry point for a bind key
+  bool setKey(const uint8_t key[16], const uint8_t mac[6], uint32_t initialCounter);
+  // Writes ciphertext, counter and MIC; returns len + BTHOME_CRYPTO_OVERHEAD, or 0 on failure
+  uint8_t seal(uint8_t info, const uint8_t* plain, uint8_t len, uint8_t* out);
+
+  // Prints the per-frame sealing cost
+  static void benchmark(Print& out, uint8_t payloadLen, uint16_t rounds);
+
+private:
+
+  mbedtls_ccm_context ccm;
+  uint8_t nonce[13];
+  uint32_t counter;
+  bool ready;
+};
+
+#endif // BTHOME_CRYPTO_H
@@ -0,0 +1,102 @@
+#ifndef BTHOME_OBJECTS_H
+#define BTHOME_OBJECTS_H
+
+#include <Arduino.h>
+#include <type_traits>
+
+// Payload limits and the per-packet service data overhead (AD length, AD type, UUID, info byte,
+// packet id object)
+static const uint8_t BTHOME_LEGACY_ADV_MAX = 31;
+static const uint8_t BTHOME_EXT_ADV_MAX = 251;
+static const uint8_t BTHOME_PACKET_OVERHEAD = 7;
+
+// One encoded BTHome object: id followed by its little-endian value bytes
+struct BTHomeObject {
+  uint8_t id;
+  uint8_t len;
+  uint8_t value[4];
+};
+
+// BTHome v2 object description. Multiplier converts the caller's unit to the encoded integer
+// (BTHome factor 0.01 -> 100); values are rounded and clamped to the encoded range.
+template <uint8_t Id, uint8_t Width, bool Signed, uint32_t Multiplier = 1>
+struct BTHomeField {
+  static_assert(Width >= 1 && Width <= 4, "BTHome values are 1-4 bytes");
+  static constexpr uint8_t id = Id;
+  static constexpr uint8_t size = 1 + Width;
+
+  template <typename T>
+  static BTHomeObject make(T value) {
+    uint64_t raw = (uint64_t)clampRaw(toRaw(value));
+    BTHomeObject o = {Id, Width, {0}};
+    for (uint8_t i = 0; i < Width; i++) o.value[i] = (uint8_t)(raw >> (8 * i));
+    return o;
+  }
+
+private:
+  static constexpr int64_t minRaw() { return Signed ? -((int64_t)1 << (8 * Width - 1)) : 0; }
+  static constexpr int64_t maxRaw() { return Signed ? ((int64_t)1 << (8 * Width - 1)) - 1 : ((int64_t)1 << (8 * Width)) - 1; }
+  static int64_t clampRaw(int64_t raw) { return raw < minRaw() ? minRaw() : (raw > maxRaw() ? maxRaw() : raw); }
+
+  static int64_t toRaw(double v) {
+    double scaled = v * Multiplier;
+    if (scaled != scaled) return 0;
+    if (scaled <= (double)minRaw()) return minRaw();
+    if (scaled >= (double)maxRaw()) return maxRaw();
+    return (int64_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+  }
+  template <typename T>
+  static typename std::enable_if<std::is_integral<T>::value, int64_t>::type toRaw(T v) {
+    return (int64_t)v * Multiplier;
+  }
+};
+
+typedef BTHomeField<0x00, 1, false> BTHomePacketId;
+typedef BTHomeField<0x01, 1, false> BTHomeBattery;         // %
+typedef BTHomeField<0x09, 1, false> BTHomeCount;
+typedef BTHomeField<0x0A, 3, false> BTHomeEnergy;          // Wh (0.001 kWh)
+typedef BTHomeField<0x0B, 3, false, 100> BTHomePowerU24;   // W (0.01 W), unsigned
+typedef BTHomeField<0x10, 1, false> BTHomePowerOn;         // binary
+typedef BTHomeField<0x19, 1, false> BTHomeConnectivity;    // binary
+typedef BTHomeField<0x4A, 2, false, 10> BTHomeVoltage;     // V (0.1 V)
+typedef BTHomeField<0x5C, 4, true, 100> BTHomePower;       // W (0.01 W)
+
+// Typed field list: size is known at compile time and encode() takes exactly one value per field
+template <typename... Fields>
+struct BTHomeFields;
+
+template <>
+struct BTHomeFields<> {
+  static constexpr uint8_t count = 0;
+  static constexpr uint16_t size = 0;
+  static uint8_t encode(BTHomeObject *) { return 0; }
+};
+
+template <typename F, typename... Rest>
+struct BTHomeFields<F, Rest...> {
+  static constexpr uint8_t count = 1 + BTHomeFields<Rest...>::count;
+  static constexpr uint16_t size = F::size + BTHomeFields<Rest...>::size;
+
+  template <typename V, typename... Vs>
+  static uint8_t encode(BTHomeObject *out, V value, Vs... rest) {
+    static_assert(sizeof...(Vs) == sizeof...(Rest), "one value per field");
+    out[0] = F::make(value);
+    return 1 + BTHomeFields<Rest...>::encode(out + 1, rest...);
+  }
+};
+
+// Up to N copies of one field, for lists whose length is only known at run time
+template <typename F, uint8_t N>
+struct BTHomeRepeated {
+  static constexpr uint8_t count = N;
+  static constexpr uint16_t size = N * F::size;
+
+  template <typename T>
+  static uint8_t encode(BTHomeObject *out, const T *values, uint8_t n) {
+    if (n > N) n = N;
+    for (uint8_t i = 0; i < n; i++) out[i] = F::make(values[i]);
+    return n;
+  }
+};
+
+#endif // BTHOME_OBJECTS_H
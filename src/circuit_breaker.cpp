@@ -0,0 +1,50 @@
+#include "circuit_breaker.h"
+
+CircuitBreaker::CircuitBreaker(uint8_t failureThreshold, unsigned long baseCooldown, unsigned long maxCooldown)
+  : threshold(failureThreshold), baseCooldownMs(baseCooldown), maxCooldownMs(maxCooldown), cooldownMs(baseCooldown) {}
+
+bool CircuitBreaker::allowRequest() {
+  if (current == CLOSED) return true;
+  if (current == HALF_OPEN) {
+    // One probe at a time; the rest wait for its outcome
+    if (probeInFlight) return false;
+    probeInFlight = true;
+    return true;
+  }
+  if (millis() - openedAtMs < cooldownMs) return false;
+  current = HALF_OPEN;
+  probeInFlight = true;
+  Serial.println("[Breaker] Half-open; probing gateway");
+  return true;
+}
+
+void CircuitBreaker::recordSuccess() {
+  if (current != CLOSED) Serial.println("[Breaker] Closed; gateway healthy");
+  current = CLOSED;
+  probeInFlight = false;
+  consecutiveFailures = 0;
+  cooldownMs = baseCooldownMs;
+}
+
+void CircuitBreaker::recordFailure() {
+  if (current == HALF_OPEN) {
+    cooldownMs = min(cooldownMs * 2, maxCooldownMs);
+    trip();
+    return;
+  }
+  if (consecutiveFailures < 255) consecutiveFailures++;
+  if (current == CLOSED && consecutiveFailures >= threshold) trip();
+}
+
+void CircuitBreaker::trip() {
+  current = OPEN;
+  probeInFlight = false;
+  openedAtMs = millis();
+  Serial.printf("[Breaker] Open after %d failures; retry in %lus\n", consecutiveFailures, cooldownMs / 1000);
+}
+
+unsigned long CircuitBreaker::retryInMs() const {
+  if (current != OPEN) return 0;
+  unsigned long elapsed = millis() - openedAtMs;
+  return elapsed >= cooldownMs ? 0 : cooldownMs - elapsed;
+}
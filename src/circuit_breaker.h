@@ -0,0 +1,33 @@
+#ifndef CIRCUIT_BREAKER_H
+#define CIRCUIT_BREAKER_H
+
+#include <Arduino.h>
+
+// Fails fast after repeated gateway failures, then lets a single probe through once the
+// cooldown expires (half-open). Each failed probe doubles the cooldown up to a cap; further
+// requests are refused until the probe's outcome is recorded.
+class CircuitBreaker {
+public:
+  enum State : uint8_t { CLOSED, OPEN, HALF_OPEN };
+
+  CircuitBreaker(uint8_t failureThreshold, unsigned long baseCooldownMs, unsigned long maxCooldownMs);
+  bool allowRequest();
+  void recordSuccess();
+  void recordFailure();
+  State state() const { return current; }
+  unsigned long retryInMs() const;
+
+private:
+  void trip();
+
+  const uint8_t threshold;
+  const unsigned long baseCooldownMs;
+  const unsigned long maxCooldownMs;
+  State current = CLOSED;
+  bool probeInFlight = false;
+  uint8_t consecutiveFailures = 0;
+  unsigned long cooldownMs;
+  unsigned long openedAtMs = 0;
+};
+
+#endif // CIRCUIT_BREAKER_H
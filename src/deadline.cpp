@@ -0,0 +1,23 @@
+#include "deadline.h"
+#include <lwip/sockets.h>
+
+static bool waitReady(int fd, const Deadline& deadline, bool forWrite) {
+  if (fd < 0) return false;
+  unsigned long waitMs = deadline.remaining();
+  if (waitMs == 0) return false;
+  fd_set set;
+  FD_ZERO(&set);
+  FD_SET(fd, &set);
+  struct timeval tv;
+  tv.tv_sec = waitMs / 1000;
+  tv.tv_usec = (waitMs % 1000) * 1000;
+  return lwip_select(fd + 1, forWrite ? nullptr : &set, forWrite ? &set : nullptr, nullptr, &tv) > 0;
+}
+
+bool waitReadable(int fd, const Deadline& deadline) {
+  return waitReady(fd, deadline, false);
+}
+
+bool waitWritable(int fd, const Deadline& deadline) {
+  return waitReady(fd, deadline, true);
+}
@@ -0,0 +1,30 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <Arduino.h>
+
+// Point in time expressed as start + span so comparisons survive the millis() rollover
+class Deadline {
+public:
+  Deadline() : startMs(millis()), spanMs(0) {}
+  explicit Deadline(unsigned long timeoutMs) : startMs(millis()), spanMs(timeoutMs) {}
+
+  bool expired() const { return millis() - startMs >= spanMs; }
+  unsigned long remaining() const {
+    unsigned long elapsed = millis() - startMs;
+    return elapsed >= spanMs ? 0 : spanMs - elapsed;
+  }
+  // Sub-deadline that ends at `limitMs` from now or at this deadline, whichever is sooner
+  Deadline capped(unsigned long limitMs) const { return Deadline(min(limitMs, remaining())); }
+
+private:
+  unsigned long startMs;
+  unsigned long spanMs;
+};
+
+// Blocks until the socket is readable or the deadline passes; false on timeout or socket error
+bool waitReadable(int fd, const Deadline& deadline);
+// Blocks until the socket can take more data or the deadline passes
+bool waitWritable(int fd, const Deadline& deadline);
+
+#endif // DEADLINE_H
@@ -9,10 +9,48 @@ void Display::begin() {
   tft.setTextSize(2);
   screenW = tft.width();
   screenH = tft.height();
+  buildGlyphTables();
   updateLayout();
+  beginTiles();
+}
+
+void Display::buildGlyphTables() {
+  // Advances and line heights per text size, measured once so layout never touches the font again
+  char glyph[2] = { 0, 0 };
+  for (int size = 1; size <= DISPLAY_MAX_TEXT_SIZE; size++) {
+    tft.setTextSize(size);
+    lineHeight[size - 1] = tft.fontHeight();
+    for (int c = 0; c < GLYPH_COUNT; c++) {
+      glyph[0] = (char)(GLYPH_FIRST + c);
+      glyphAdvance[size - 1][c] = (uint8_t)tft.textWidth(glyph);
+    }
+  }
+  tft.setTextSize(2);
+}
+
+void Display::beginTiles() {
+#if DISPLAY_TILE_W > 0 && DISPLAY_TILE_H > 0
+  for (int i = 0; i < 2; i++) {
+    tiles[i] = new TFT_eSprite(&tft);
+    tiles[i]->setColorDepth(16);
+    if (!tiles[i]->createSprite(DISPLAY_TILE_W, DISPLAY_TILE_H)) {
+      Serial.printf("Display: no RAM for %dx%d tiles; drawing directly\n", DISPLAY_TILE_W, DISPLAY_TILE_H);
+      for (int j = 0; j <= i; j++) { tiles[j]->deleteSprite(); delete tiles[j]; tiles[j] = nullptr; }
+      return;
+    }
+  }
+  tft.initDMA();
+  tileW = DISPLAY_TILE_W;
+  tileH = DISPLAY_TILE_H;
+  tileCols = (screenW + tileW - 1) / tileW;
+  tileRows = (screenH + tileH - 1) / tileH;
+  dirtyTiles.assign(tileCols * tileRows, 0);
+  useTiles = true;
+#endif
 }
 
 void Display::showBoot() {
+  finishPush();
   tft.fillScreen(bgColor);
   tft.setTextDatum(MC_DATUM);
   tft.setTextSize(2);
@@ -20,114 +58,422 @@ void Display::showBoot() {
   tft.setTextSize(1);
   tft.drawString("Starting...", screenW / 2, screenH / 2 + (tft.fontHeight() / 2 + 4));
   tft.setTextSize(2);
+  chromeDrawn = false;
 }
 
-void Display::render(const PowerwallData& data, const HomeAutomationData& ha, bool isConnected) {
-  tft.fillScreen(bgColor);
+void Display::startTask() {
+  snapshotLock = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(taskEntry, "display", 4096, this, DISPLAY_TASK_PRIORITY, &task, DISPLAY_TASK_CORE);
+}
 
-  drawHeader(isConnected);
-  int16_t y = headerH + padding;
-  y = drawBattery(data, y) + padding;
-  y = drawHA(ha, y) + padding;
+void Display::publish(const PowerwallData& data, const HomeAutomationData& ha, LinkState link, bool newSample) {
+  xSemaphoreTake(snapshotLock, portMAX_DELAY);
+  shared.data = data;
+  shared.ha = ha;
+  shared.link = link;
+  shared.published = true;
+  shared.newSample = shared.newSample || newSample;
+  xSemaphoreGive(snapshotLock);
+  xTaskNotifyGive(task);
 }
 
-void Display::drawHeader(bool isConnected) {
-  int16_t h = headerH;
-  tft.fillRect(0, 0, screenW, h, TFT_DARKGREY);
-  tft.setTextDatum(TL_DATUM);
-  tft.setTextColor(TFT_WHITE, TFT_DARKGREY);
-  tft.setTextSize(headerTextSize);
-  int16_t hH = measureTextHeight(headerTextSize);
-  int16_t yTop = (h - hH) / 2; if (yTop < 1) yTop = 1;
-  tft.drawString("Powerwall", padding, yTop);
+void Display::requestNextPage() {
+  xSemaphoreTake(snapshotLock, portMAX_DELAY);
+  shared.pageToggles++;
+  xSemaphoreGive(snapshotLock);
+  xTaskNotifyGive(task);
+}
 
-  tft.setTextDatum(TR_DATUM);
-  tft.setTextColor(isConnected ? TFT_GREEN : TFT_RED, TFT_DARKGREY);
-  tft.setTextSize(statusTextSize);
-  tft.drawString(isConnected ? "Connected" : "Offline", screenW - padding, yTop);
+void Display::taskEntry(void* arg) {
+  static_cast<Display*>(arg)->taskLoop();
 }
 
-void Display::drawBatteryBar(float percent, int16_t x, int16_t y, int16_t w, int16_t h) {
-  if (percent < 0) percent = 0; if (percent > 100) percent = 100;
+void Display::taskLoop() {
+  Snapshot snap;
+  unsigned long lastFrameMs = 0;
+  for (;;) {
+    // Wake on a new snapshot, or once a second so the data age keeps counting
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+    unsigned long since = millis() - lastFrameMs;
+    if (since < DISPLAY_MIN_FRAME_MS) {
+      vTaskDelay(pdMS_TO_TICKS(DISPLAY_MIN_FRAME_MS - since));
+      ulTaskNotifyTake(pdTRUE, 0);
+    }
+
+    xSemaphoreTake(snapshotLock, portMAX_DELAY);
+    snap.data = shared.data;
+    snap.ha = shared.ha;
+    snap.link = shared.link;
+    snap.published = shared.published;
+    snap.newSample = shared.newSample;
+    snap.pageToggles = shared.pageToggles;
+    shared.newSample = false;
+    shared.pageToggles = 0;
+    xSemaphoreGive(snapshotLock);
+    if (!snap.published) continue;
+
+    if (snap.newSample && history) history->add(snap.ha);
+    if (snap.pageToggles & 1) nextPage();
+    render(snap.data, snap.ha, snap.link);
+    lastFrameMs = millis();
+  }
+}
+
+void Display::render(const PowerwallData& data, const HomeAutomationData& ha, LinkState link) {
+  // Only widgets whose content changed since the last frame touch the panel
+  finishPush();
+  if (!chromeDrawn) drawChrome();
+
+  drawHeader(link, ha);
+  if (page == PAGE_HISTORY) {
+    drawChart();
+  } else {
+    int16_t y = headerH + padding;
+    y = drawBattery(data, y) + padding;
+    y = drawHA(ha, y) + padding;
+    if (ha.block_count > 1) y = drawBlocks(ha, y) + padding;
+    else placeText(SLOT_BLOCKS, "", haTextSize, padding, y, fgColor);
+  }
+  flushText();
+  if (useTiles) pushDirtyTiles();
+}
+
+void Display::nextPage() {
+  page = (page == PAGE_SUMMARY) ? PAGE_HISTORY : PAGE_SUMMARY;
+  chromeDrawn = false;
+}
+
+void Display::drawChrome() {
+  drawnFillW = 0;
+  drawnFillColor = bgColor;
+  chartTotal = 0;
+  chartScaleW = 0;
+  for (int i = 0; i < SLOT_COUNT; i++) drawn[i] = pending[i] = TextSlot();
+  chromeDrawn = true;
+  if (useTiles) {
+    markDirty(0, 0, screenW, screenH);
+    return;
+  }
+  tft.fillScreen(bgColor);
+  paintChrome(tft, 0, 0);
+}
+
+void Display::paintChrome(TFT_eSPI& g, int16_t ox, int16_t oy) {
+  // Static parts: header bar and title, battery outline
+  g.fillRect(-ox, -oy, screenW, headerH, TFT_DARKGREY);
+  g.setTextDatum(TL_DATUM);
+  g.setTextColor(TFT_WHITE, TFT_DARKGREY);
+  g.setTextSize(headerTextSize);
+  g.drawString("Powerwall", padding - ox, headerTextY - oy);
+  if (page != PAGE_SUMMARY) return;
+
   uint16_t frame = TFT_WHITE;
-  uint16_t fill = percent > 80 ? TFT_GREEN : (percent > 30 ? TFT_YELLOW : TFT_RED);
-  // Draw battery outline
-  tft.drawRect(x, y, w, h, frame);
+  g.drawRect(barX - ox, barY - oy, barW, barH, frame);
   // battery tip
   int16_t tipW = 6;
-  int16_t tipH = h / 3;
-  int16_t tipY = y + (h - tipH) / 2;
-  tft.drawRect(x + w, tipY, tipW, tipH, frame);
-  // Fill level
-  int16_t inner = w - 4;
+  int16_t tipH = barH / 3;
+  int16_t tipY = barY + (barH - tipH) / 2;
+  g.drawRect(barX + barW - ox, tipY - oy, tipW, tipH, frame);
+}
+
+void Display::drawHeader(LinkState link, const HomeAutomationData& ha) {
+  // Link state plus the age of the data on screen, right-aligned in the header bar
+  static const char* const labels[] = { "Offline", "Degraded", "Connected" };
+  static const uint16_t colors[] = { TFT_RED, TFT_ORANGE, TFT_GREEN };
+  char label[24];
+  if (ha.valid) {
+    unsigned long age = (millis() - ha.last_update_ms) / 1000;
+    if (age < 60) snprintf(label, sizeof(label), "%s %lus", labels[link], age);
+    else if (age < 3600) snprintf(label, sizeof(label), "%s %lum", labels[link], age / 60);
+    else snprintf(label, sizeof(label), "%s %luh", labels[link], age / 3600);
+  } else {
+    snprintf(label, sizeof(label), "%s", labels[link]);
+  }
+  int16_t w = measureTextWidth(label, statusTextSize);
+  placeText(SLOT_STATUS, label, statusTextSize, screenW - padding - w, headerTextY, colors[link], TFT_DARKGREY);
+}
+
+void Display::drawBatteryFill(float percent) {
+  if (percent < 0) percent = 0; if (percent > 100) percent = 100;
+  uint16_t fill = percent > 80 ? TFT_GREEN : (percent > 30 ? TFT_YELLOW : TFT_RED);
+  int16_t inner = barW - 4;
   int16_t level = (int16_t)(inner * (percent / 100.0f));
-  tft.fillRect(x + 2, y + 2, level, h - 4, fill);
+  int16_t x = barX + 2;
+  int16_t y = barY + 2;
+  int16_t h = barH - 4;
+  if (useTiles) {
+    // Dirty only the strip between the old and new level, or the whole fill on a colour change
+    if (fill != drawnFillColor) markDirty(x, y, max(level, drawnFillW), h);
+    else markDirty(x + min(level, drawnFillW), y, abs(level - drawnFillW), h);
+  } else if (fill != drawnFillColor) {
+    // Colour band changed: repaint the whole fill
+    tft.fillRect(x, y, level, h, fill);
+    if (drawnFillW > level) tft.fillRect(x + level, y, drawnFillW - level, h, bgColor);
+  } else if (level > drawnFillW) {
+    tft.fillRect(x + drawnFillW, y, level - drawnFillW, h, fill);
+  } else if (level < drawnFillW) {
+    tft.fillRect(x + level, y, drawnFillW - level, h, bgColor);
+  }
+  drawnFillW = level;
+  drawnFillColor = fill;
+}
+
+void Display::paintFill(TFT_eSPI& g, int16_t ox, int16_t oy) {
+  if (drawnFillW > 0) g.fillRect(barX + 2 - ox, barY + 2 - oy, drawnFillW, barH - 4, drawnFillColor);
 }
 
 int16_t Display::drawBattery(const PowerwallData& data, int16_t startY) {
   int16_t left = padding;
   float pct = data.data_valid ? data.battery_level : 0.0f;
-  drawBatteryBar(pct, barX, startY, barW, barH);
+  drawBatteryFill(pct);
 
   // Percent text sized to fit percentAreaW
-  tft.setTextDatum(TL_DATUM);
-  tft.setTextColor(fgColor, bgColor);
   char line[32];
-  if (data.data_valid) snprintf(line, sizeof(line), "%.1f%%", pct); else snprintf(line, sizeof(line), "--.-%%");
-  int fitSize = fitTextSizeForBox(line, percentAreaW - percentGap, barH);
-  tft.setTextSize(fitSize);
-  tft.drawString(line, barX + barW + padding + percentGap, startY + (barH - measureTextHeight(fitSize)) / 2);
-  tft.setTextSize(haTextSize);
+  static const char* const pctFmt = "%.1f%%";
+  if (data.data_valid) snprintf(line, sizeof(line), pctFmt, pct); else snprintf(line, sizeof(line), "--.-%%");
+  int fitSize = fitTextSizeForBox(pctFmt, line, percentAreaW - percentGap, barH);
+  placeText(SLOT_PERCENT, line, fitSize, barX + barW + padding + percentGap, startY + (barH - measureTextHeight(fitSize)) / 2, fgColor);
 
   // Energy line below bar
   char ebuf[48];
+  static const char* const energyFmt = "Rem %.0f / %.0f Wh";
   if (data.data_valid && data.total_pack_energy > 0) {
-    snprintf(ebuf, sizeof(ebuf), "Rem %.0f / %.0f Wh", data.energy_remaining, data.total_pack_energy);
+    snprintf(ebuf, sizeof(ebuf), energyFmt, data.energy_remaining, data.total_pack_energy);
   } else {
     snprintf(ebuf, sizeof(ebuf), "Rem -- / -- Wh");
   }
-  tft.setTextDatum(TL_DATUM);
-  int eSize = fitTextSizeForBox(ebuf, screenW - 2 * padding, textH);
-  tft.setTextSize(eSize);
-  tft.drawString(ebuf, left, startY + barH + lineGap + 2);
-  int16_t usedH = measureTextHeight(eSize);
-  tft.setTextSize(haTextSize);
+  int eSize = fitTextSizeForBox(energyFmt, ebuf, screenW - 2 * padding, textH);
+  int16_t usedH = placeText(SLOT_ENERGY, ebuf, eSize, left, startY + barH + lineGap + 2, fgColor);
   return startY + barH + lineGap + 2 + usedH;
 }
 
 int16_t Display::drawHA(const HomeAutomationData& ha, int16_t startY) {
   int16_t y = startY + lineGap;
-  tft.setTextDatum(TL_DATUM);
-  tft.setTextColor(accentColor, bgColor);
   // Keep the section title modest to avoid over-scaling
-  int tSize = min(2, fitTextSizeForBox("Power (W)", screenW - 2 * padding, textH));
-  tft.setTextSize(tSize);
-  tft.drawString("Power (W)", padding, y);
-  y += measureTextHeight(tSize) + lineGap;
-  tft.setTextColor(fgColor, bgColor);
+  static const char* const title = "Power (W)";
+  int tSize = min(2, fitTextSizeForBox(title, title, screenW - 2 * padding, textH));
+  y += placeText(SLOT_POWER_TITLE, title, tSize, padding, y, accentColor) + lineGap;
 
   char buf[64];
   if (ha.valid) {
-    snprintf(buf, sizeof(buf), "Site: %.0f  Load: %.0f", ha.site_power_w, ha.load_power_w);
-    int s1 = fitTextSizeForBox(buf, screenW - 2 * padding, textH);
-    tft.setTextSize(s1);
-    tft.drawString(buf, padding, y); y += measureTextHeight(s1) + lineGap;
-    snprintf(buf, sizeof(buf), "Solar: %.0f  Batt: %.0f", ha.solar_power_w, ha.battery_power_w);
-    int s2 = fitTextSizeForBox(buf, screenW - 2 * padding, textH);
-    tft.setTextSize(s2);
-    tft.drawString(buf, padding, y); y += measureTextHeight(s2) + lineGap;
-    snprintf(buf, sizeof(buf), "Grid: %s  Mode: %s", ha.grid_connected ? "Yes" : "No", ha.island_mode.c_str());
-    int s3 = fitTextSizeForBox(buf, screenW - 2 * padding, textH);
-    tft.setTextSize(s3);
-    tft.drawString(buf, padding, y); y += measureTextHeight(s3) + lineGap;
+    static const char* const fmt1 = "Site: %.0f  Load: %.0f";
+    static const char* const fmt2 = "Solar: %.0f  Batt: %.0f";
+    static const char* const fmt3 = "Grid: %s  Mode: %s";
+    snprintf(buf, sizeof(buf), fmt1, ha.site_power_w, ha.load_power_w);
+    int s1 = fitTextSizeForBox(fmt1, buf, screenW - 2 * padding, textH);
+    y += placeText(SLOT_POWER_1, buf, s1, padding, y, fgColor) + lineGap;
+    snprintf(buf, sizeof(buf), fmt2, ha.solar_power_w, ha.battery_power_w);
+    int s2 = fitTextSizeForBox(fmt2, buf, screenW - 2 * padding, textH);
+    y += placeText(SLOT_POWER_2, buf, s2, padding, y, fgColor) + lineGap;
+    snprintf(buf, sizeof(buf), fmt3, ha.grid_connected ? "Yes" : "No", ha.island_mode);
+    int s3 = fitTextSizeForBox(fmt3, buf, screenW - 2 * padding, textH);
+    y += placeText(SLOT_POWER_3, buf, s3, padding, y, fgColor) + lineGap;
   } else {
-    int s0 = fitTextSizeForBox("No HA data", screenW - 2 * padding, textH);
-    tft.setTextSize(s0);
-    tft.drawString("No HA data", padding, y); y += measureTextHeight(s0) + lineGap;
+    int s0 = fitTextSizeForBox("No HA data", "No HA data", screenW - 2 * padding, textH);
+    y += placeText(SLOT_POWER_1, "No HA data", s0, padding, y, fgColor) + lineGap;
+    placeText(SLOT_POWER_2, "", s0, padding, y, fgColor);
+    placeText(SLOT_POWER_3, "", s0, padding, y, fgColor);
   }
   return y;
 }
 
+int16_t Display::drawBlocks(const HomeAutomationData& ha, int16_t startY) {
+  int16_t y = startY;
+  // One compact entry per battery block: index, percent and power
+  static const char* const entryFmt = "%sB%d %.0f%% %.0fW";
+  char buf[96];
+  size_t used = 0;
+  buf[0] = '\0';
+  for (uint8_t i = 0; i < ha.block_count && used < sizeof(buf); i++) {
+    const BatteryBlockData& b = ha.blocks[i];
+    if (b.valid) used += snprintf(buf + used, sizeof(buf) - used, entryFmt, i ? "  " : "", i + 1, b.battery_percent, b.power_w);
+    else used += snprintf(buf + used, sizeof(buf) - used, "%sB%d --", i ? "  " : "", i + 1);
+  }
+  int s = fitTextSizeForBox(entryFmt, buf, screenW - 2 * padding, textH);
+  y += placeText(SLOT_BLOCKS, buf, s, padding, y, fgColor) + lineGap;
+  return y;
+}
+
+static const uint16_t SERIES_COLORS[SERIES_COUNT] = { TFT_YELLOW, TFT_CYAN, TFT_MAGENTA, TFT_GREEN };
+
+void Display::drawChart() {
+  static const char* const names[SERIES_COUNT] = { "Solar", "Load", "Site", "Batt" };
+  int16_t x = padding;
+  int16_t y = headerH + padding;
+  for (uint8_t s = 0; s < SERIES_COUNT; s++) {
+    placeText((Slot)(SLOT_LEGEND_SOLAR + s), names[s], 1, x, y, SERIES_COLORS[s]);
+    x += measureTextWidth(names[s], 1) + measureTextWidth("  ", 1);
+  }
+  if (!history) return;
+
+  uint32_t total = history->total(DISPLAY_CHART_LEVEL);
+  // The scale only grows while the page is up; growing it is the one case that repaints the whole plot
+  int32_t scale = max(chartScaleW, chartScaleFor(total));
+  char label[24];
+  snprintf(label, sizeof(label), "+/-%ld kW", (long)(scale / 1000));
+  placeText(SLOT_CHART_SCALE, label, 1, screenW - padding - measureTextWidth(label, 1), y, fgColor);
+
+  int16_t first = 0, last = -1;
+  if (scale != chartScaleW || total - chartTotal >= (uint32_t)(chartW - DISPLAY_CHART_GAP)) {
+    first = 0;
+    last = chartW - 1;
+  } else if (total != chartTotal) {
+    // Sweep: the new columns plus the blank gap ahead of them
+    first = chartTotal % chartW;
+    last = first + (total - chartTotal) + DISPLAY_CHART_GAP - 1;
+  }
+  chartScaleW = scale;
+  chartTotal = total;
+  for (int16_t c = first; c <= last; c++) {
+    int16_t col = c % chartW;
+    if (useTiles) markDirty(chartX + col, chartY, 1, socY + socH - chartY);
+    else paintChartColumns(tft, 0, 0, col, col);
+  }
+}
+
+int32_t Display::chartScaleFor(uint32_t total) const {
+  // Symmetric scale in whole kW covering every bucket on screen
+  int32_t peak = 0;
+  uint16_t shown = min<uint32_t>(history->size(DISPLAY_CHART_LEVEL), chartW - DISPLAY_CHART_GAP);
+  for (uint16_t age = 0; age < shown; age++) {
+    const HistoryBucket& b = history->at(DISPLAY_CHART_LEVEL, age);
+    for (uint8_t s = 0; s < SERIES_COUNT; s++) peak = max(peak, (int32_t)max(abs(b.minW[s]), abs(b.maxW[s])));
+  }
+  return max<int32_t>(1000, (peak + 999) / 1000 * 1000);
+}
+
+void Display::paintChartColumns(TFT_eSPI& g, int16_t ox, int16_t oy, int16_t c0, int16_t c1) {
+  int16_t zeroY = chartY + chartH / 2;
+  uint32_t total = chartTotal;
+  for (int16_t c = c0; c <= c1; c++) {
+    int16_t x = chartX + c - ox;
+    g.drawFastVLine(x, chartY - oy, chartH, bgColor);
+    g.drawFastVLine(x, socY - oy, socH, bgColor);
+    g.drawPixel(x, zeroY - oy, TFT_DARKGREY);
+    if (!history || total == 0) continue;
+    // Column c shows the newest bucket whose sequence number is congruent to c
+    uint16_t age = (uint16_t)(((total - 1) % chartW + chartW - c) % chartW);
+    if (age >= history->size(DISPLAY_CHART_LEVEL) || age >= chartW - DISPLAY_CHART_GAP) continue;
+    const HistoryBucket& b = history->at(DISPLAY_CHART_LEVEL, age);
+    for (uint8_t s = 0; s < SERIES_COUNT; s++) {
+      int16_t yTop = zeroY - (int32_t)b.maxW[s] * (chartH / 2) / chartScaleW;
+      int16_t yBottom = zeroY - (int32_t)b.minW[s] * (chartH / 2) / chartScaleW;
+      yTop = constrain(yTop, chartY, chartY + chartH - 1);
+      yBottom = constrain(yBottom, chartY, chartY + chartH - 1);
+      g.drawFastVLine(x, yTop - oy, yBottom - yTop + 1, SERIES_COLORS[s]);
+    }
+    int16_t socTop = socY + socH - 1 - (int32_t)b.socMax * (socH - 1) / 200;
+    int16_t socBottom = socY + socH - 1 - (int32_t)b.socMin * (socH - 1) / 200;
+    g.drawFastVLine(x, socTop - oy, socBottom - socTop + 1, fgColor);
+  }
+}
+
+int16_t Display::placeText(Slot slot, const char* text, int size, int16_t x, int16_t y, uint16_t color) {
+  return placeText(slot, text, size, x, y, color, bgColor);
+}
+
+int16_t Display::placeText(Slot slot, const char* text, int size, int16_t x, int16_t y, uint16_t color, uint16_t bg) {
+  TextSlot& t = pending[slot];
+  strncpy(t.text, text, sizeof(t.text) - 1);
+  t.text[sizeof(t.text) - 1] = '\0';
+  t.x = x;
+  t.y = y;
+  t.size = size;
+  t.color = color;
+  t.bg = bg;
+  t.h = measureTextHeight(size);
+  t.w = text[0] ? measureTextWidth(text, size) : 0;
+  return t.h;
+}
+
+void Display::flushText() {
+  bool changed[SLOT_COUNT];
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    const TextSlot& o = drawn[i];
+    const TextSlot& n = pending[i];
+    changed[i] = strcmp(o.text, n.text) != 0 || o.x != n.x || o.y != n.y || o.size != n.size || o.color != n.color || o.bg != n.bg;
+  }
+  if (useTiles) {
+    // Tiles are composed from the retained state, so a changed line only dirties its old and new boxes
+    for (int i = 0; i < SLOT_COUNT; i++) {
+      if (!changed[i]) continue;
+      markDirty(drawn[i].x, drawn[i].y, drawn[i].w, drawn[i].h);
+      markDirty(pending[i].x, pending[i].y, pending[i].w, pending[i].h);
+      drawn[i] = pending[i];
+    }
+    return;
+  }
+  // Erase every stale area before drawing, so a line that moved is not wiped by its neighbour's old extent
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (!changed[i]) continue;
+    const TextSlot& o = drawn[i];
+    const TextSlot& n = pending[i];
+    if (o.x == n.x && o.y == n.y && o.size == n.size) {
+      // Same box: the new glyphs paint their own background, only a shorter tail needs clearing
+      if (o.w > n.w) tft.fillRect(n.x + n.w, o.y, o.w - n.w, o.h, o.bg);
+    } else if (o.w > 0) {
+      tft.fillRect(o.x, o.y, o.w, o.h, o.bg);
+    }
+  }
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (!changed[i]) continue;
+    drawn[i] = pending[i];
+    paintText(tft, drawn[i], 0, 0);
+  }
+  tft.setTextSize(haTextSize);
+}
+
+void Display::paintText(TFT_eSPI& g, const TextSlot& t, int16_t ox, int16_t oy) {
+  if (!t.text[0]) return;
+  g.setTextDatum(TL_DATUM);
+  g.setTextColor(t.color, t.bg);
+  g.setTextSize(t.size);
+  g.drawString(t.text, t.x - ox, t.y - oy);
+}
+
+void Display::markDirty(int16_t x, int16_t y, int16_t w, int16_t h) {
+  if (w <= 0 || h <= 0) return;
+  int16_t c0 = max<int16_t>(0, x / tileW), c1 = min<int16_t>(tileCols - 1, (x + w - 1) / tileW);
+  int16_t r0 = max<int16_t>(0, y / tileH), r1 = min<int16_t>(tileRows - 1, (y + h - 1) / tileH);
+  for (int16_t r = r0; r <= r1; r++) {
+    for (int16_t c = c0; c <= c1; c++) dirtyTiles[r * tileCols + c] = 1;
+  }
+}
+
+void Display::pushDirtyTiles() {
+  // Buffers alternate: while one tile is on the SPI bus the next is composed in the other.
+  // pushImageDMA waits for the previous transfer itself and clips tiles hanging off the panel edge.
+  tft.startWrite();
+  dmaActive = true;
+  for (int16_t r = 0; r < tileRows; r++) {
+    for (int16_t c = 0; c < tileCols; c++) {
+      uint8_t& dirty = dirtyTiles[r * tileCols + c];
+      if (!dirty) continue;
+      dirty = 0;
+      int16_t ox = c * tileW;
+      int16_t oy = r * tileH;
+      TFT_eSprite* t = tiles[nextTile];
+      nextTile ^= 1;
+      t->fillSprite(bgColor);
+      paintChrome(*t, ox, oy);
+      paintFill(*t, ox, oy);
+      if (page == PAGE_HISTORY) {
+        paintChartColumns(*t, ox, oy, max<int16_t>(0, ox - chartX), min<int16_t>(chartW - 1, ox + tileW - 1 - chartX));
+      }
+      for (int i = 0; i < SLOT_COUNT; i++) paintText(*t, drawn[i], ox, oy);
+      tft.pushImageDMA(ox, oy, tileW, tileH, (uint16_t*)t->getPointer());
+    }
+  }
+}
+
+void Display::finishPush() {
+  // The last tile of a frame is left in flight so the caller can get back to work; settle it before drawing again
+  if (!dmaActive) return;
+  tft.dmaWait();
+  tft.endWrite();
+  dmaActive = false;
+}
+
 void Display::updateLayout() {
   // Metrics using helpers to avoid clipping
   textH = measureTextHeight(haTextSize);
@@ -136,6 +482,14 @@ void Display::updateLayout() {
   int16_t remainingH = screenH - headerH - 4 * padding - measureTextHeight(haTextSize) * 4; // HA title + 3 lines
   if (remainingH < 40) remainingH = 40;
   barH = (int16_t)max((int16_t)18, (int16_t)(remainingH * 6 / 10));
+  barY = headerH + padding;
+  headerTextY = (headerH - measureTextHeight(headerTextSize)) / 2; if (headerTextY < 1) headerTextY = 1;
+  // Chart page: legend row, then the power plot and the SoC strip
+  chartX = padding;
+  chartW = screenW - 2 * padding;
+  chartY = headerH + padding + measureTextHeight(1) + lineGap;
+  socY = screenH - padding - socH;
+  chartH = socY - padding - chartY;
   // Layout battery bar and percent side-by-side
   percentAreaW = 72; // Slightly smaller to keep gap from bar
   barX = padding;
@@ -144,23 +498,40 @@ void Display::updateLayout() {
 }
 
 int16_t Display::measureTextWidth(const char* s, int size) {
-  tft.setTextSize(size);
-  return tft.textWidth(s);
+  size = constrain(size, 1, DISPLAY_MAX_TEXT_SIZE);
+  const uint8_t* advance = glyphAdvance[size - 1];
+  int16_t w = 0;
+  for (; *s; s++) {
+    uint8_t c = (uint8_t)*s;
+    if (c >= GLYPH_FIRST && c < GLYPH_FIRST + GLYPH_COUNT) w += advance[c - GLYPH_FIRST];
+  }
+  return w;
 }
 
 int16_t Display::measureTextHeight(int size) {
-  tft.setTextSize(size);
-  return tft.fontHeight();
+  return lineHeight[constrain(size, 1, DISPLAY_MAX_TEXT_SIZE) - 1];
 }
 
-int Display::fitTextSizeForBox(const char* s, int maxW, int maxH) {
-  int size = min(percentTextMaxSize, 4); // guard upper bound
-  for (; size >= 1; size--) {
-    int w = measureTextWidth(s, size);
-    int h = measureTextHeight(size);
-    if (w <= maxW && h <= maxH) return size;
+int Display::fitTextSizeForBox(const char* layoutKey, const char* s, int maxW, int maxH) {
+  // Lines from one template with the same length and digit count have the same width, so the
+  // fitted size is cached per (template, length, digits, box)
+  uint8_t len = 0, digits = 0;
+  for (const char* p = s; *p && len < 255; p++, len++) {
+    if (*p >= '0' && *p <= '9') digits++;
   }
-  return 1;
-}
-
+  uint32_t hash = (uint32_t)(uintptr_t)layoutKey * 2654435761u ^ ((uint32_t)len << 8 | digits) ^ ((uint32_t)maxW << 16) ^ (uint32_t)maxH;
+  LayoutEntry& e = layoutCache[(hash >> 16) % LAYOUT_CACHE_SIZE];
+  if (e.key == layoutKey && e.len == len && e.digits == digits && e.maxW == maxW && e.maxH == maxH) return e.size;
 
+  int size = DISPLAY_MAX_TEXT_SIZE;
+  for (; size > 1; size--) {
+    if (measureTextWidth(s, size) <= maxW && measureTextHeight(size) <= maxH) break;
+  }
+  e.key = layoutKey;
+  e.len = len;
+  e.digits = digits;
+  e.maxW = maxW;
+  e.maxH = maxH;
+  e.size = size;
+  return size;
+}
@@ -2,11 +2,98 @@
 #define DISPLAY_H
 
 #include <Arduino.h>
-#include <TFT_eSPI.h>
 #include "powerwall.h"
 
+#ifdef DISPLAY_HEADLESS
+// Headless profile: a no-op sink so no TFT driver, fonts, sprites or render task are linked in
+class Display {
+public:
+  void begin() {}
+  void showBoot() {}
+  void startTask() {}
+  void publish(const PowerwallData&, const HomeAutomationData&, LinkState, bool) {}
+  void requestNextPage() {}
+};
+#else
+
+#include <TFT_eSPI.h>
+#include <vector>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "history.h"
+
+// Off-screen composition: dirty tiles are drawn into two RAM sprites and pushed with DMA.
+// Each sprite takes DISPLAY_TILE_W x DISPLAY_TILE_H x 2 bytes. The default 240x16 band costs
+// 15 KB for both; 240x135 composes whole frames (2 x 64.8 KB, too much next to TLS on the
+// T-Display). Set either to 0 to draw straight to the panel.
+#ifndef DISPLAY_TILE_W
+#define DISPLAY_TILE_W 240
+#endif
+#ifndef DISPLAY_TILE_H
+#define DISPLAY_TILE_H 16
+#endif
+// Largest text size the layout uses; glyph metrics are precomputed up to it
+#define DISPLAY_MAX_TEXT_SIZE 2
+// History level plotted on the chart page, one column per bucket
+#ifndef DISPLAY_CHART_LEVEL
+#define DISPLAY_CHART_LEVEL 1
+#endif
+// Blank columns ahead of the newest one on the sweeping chart
+#define DISPLAY_CHART_GAP 4
+// Rendering runs on its own task on the application core, below loopTask (priority 1), so SPI and
+// DMA composition stay off core 0 with the Wi-Fi and lwIP tasks and yield to the TEDAPI I/O
+#ifndef DISPLAY_TASK_CORE
+#define DISPLAY_TASK_CORE 1
+#endif
+#ifndef DISPLAY_TASK_PRIORITY
+#define DISPLAY_TASK_PRIORITY 0
+#endif
+// Minimum spacing between frames; snapshots arriving faster are coalesced into one frame
+#define DISPLAY_MIN_FRAME_MS 250
+
 class Display {
 private:
+  // Text widgets, in screen order; each remembers what it last drew so unchanged lines are not repainted
+  enum Slot {
+    SLOT_STATUS, SLOT_PERCENT, SLOT_ENERGY, SLOT_POWER_TITLE, SLOT_POWER_1, SLOT_POWER_2, SLOT_POWER_3, SLOT_BLOCKS,
+    SLOT_LEGEND_SOLAR, SLOT_LEGEND_LOAD, SLOT_LEGEND_SITE, SLOT_LEGEND_BATTERY, SLOT_CHART_SCALE,
+    SLOT_COUNT
+  };
+  enum Page : uint8_t { PAGE_SUMMARY, PAGE_HISTORY };
+  // Latest state handed over by loop(); the render task works from a private copy
+  struct Snapshot {
+    PowerwallData data;
+    HomeAutomationData ha;
+    LinkState link = LINK_OFFLINE;
+    bool published = false;   // boot screen stays up until the first snapshot
+    bool newSample = false;
+    uint8_t pageToggles = 0;
+  };
+  // Fitted text size for a line template; width depends only on length and digit count
+  struct LayoutEntry {
+    const char* key = nullptr;
+    uint8_t len = 0;
+    uint8_t digits = 0;
+    int16_t maxW = 0;
+    int16_t maxH = 0;
+    uint8_t size = 1;
+  };
+  static const uint8_t GLYPH_FIRST = 32;
+  static const uint8_t GLYPH_COUNT = 95;
+  static const uint8_t LAYOUT_CACHE_SIZE = 16;
+
+  struct TextSlot {
+    char text[96] = {0};
+    int16_t x = 0;
+    int16_t y = 0;
+    int16_t w = 0;
+    int16_t h = 0;
+    int size = 0;
+    uint16_t color = 0;
+    uint16_t bg = 0;
+  };
+
   TFT_eSPI tft;
   uint16_t bgColor = TFT_BLACK;
   uint16_t fgColor = TFT_WHITE;
@@ -25,24 +112,84 @@ private:
   int headerTextSize = 2;
   int statusTextSize = 1;
   int haTextSize = 2;
-  int percentTextMaxSize = 2;
+  int16_t barY = 0;
+  uint8_t glyphAdvance[DISPLAY_MAX_TEXT_SIZE][GLYPH_COUNT] = {};
+  int16_t lineHeight[DISPLAY_MAX_TEXT_SIZE] = {};
+  LayoutEntry layoutCache[LAYOUT_CACHE_SIZE];
+  int16_t headerTextY = 0;
+  // History chart: power plot over an SoC strip
+  int16_t chartX = 0;
+  int16_t chartY = 0;
+  int16_t chartW = 0;
+  int16_t chartH = 0;
+  int16_t socY = 0;
+  int16_t socH = 20;
+  PowerHistory* history = nullptr;
+  uint8_t page = PAGE_SUMMARY;
+  // Retained state of what is currently on the panel
+  bool chromeDrawn = false;
+  int16_t drawnFillW = 0;
+  uint16_t drawnFillColor = 0;
+  TextSlot drawn[SLOT_COUNT];
+  TextSlot pending[SLOT_COUNT];
+  uint32_t chartTotal = 0;
+  int32_t chartScaleW = 0;
+  // Tile composition
+  TFT_eSprite* tiles[2] = { nullptr, nullptr };
+  bool useTiles = false;
+  bool dmaActive = false;
+  uint8_t nextTile = 0;
+  int16_t tileW = 0;
+  int16_t tileH = 0;
+  int16_t tileCols = 0;
+  int16_t tileRows = 0;
+  std::vector<uint8_t> dirtyTiles;
+  // Render task
+  Snapshot shared;
+  SemaphoreHandle_t snapshotLock = nullptr;
+  TaskHandle_t task = nullptr;
 
   void updateLayout();
   int16_t measureTextWidth(const char* s, int size);
   int16_t measureTextHeight(int size);
-  int fitTextSizeForBox(const char* s, int maxW, int maxH);
+  int fitTextSizeForBox(const char* layoutKey, const char* s, int maxW, int maxH);
 
-  void drawHeader(bool isConnected);
+  void buildGlyphTables();
+  void beginTiles();
+  void drawChrome();
+  void paintChrome(TFT_eSPI& g, int16_t ox, int16_t oy);
+  void paintFill(TFT_eSPI& g, int16_t ox, int16_t oy);
+  void paintText(TFT_eSPI& g, const TextSlot& t, int16_t ox, int16_t oy);
+  void markDirty(int16_t x, int16_t y, int16_t w, int16_t h);
+  void pushDirtyTiles();
+  void finishPush();
+  void drawHeader(LinkState link, const HomeAutomationData& ha);
   int16_t drawBattery(const PowerwallData& data, int16_t startY);
   int16_t drawHA(const HomeAutomationData& ha, int16_t startY);
-  void drawBatteryBar(float percent, int16_t x, int16_t y, int16_t w, int16_t h);
+  int16_t drawBlocks(const HomeAutomationData& ha, int16_t startY);
+  void drawBatteryFill(float percent);
+  int16_t placeText(Slot slot, const char* text, int size, int16_t x, int16_t y, uint16_t color);
+  int16_t placeText(Slot slot, const char* text, int size, int16_t x, int16_t y, uint16_t color, uint16_t bg);
+  void flushText();
+  static void taskEntry(void* arg);
+  void taskLoop();
+  void render(const PowerwallData& data, const HomeAutomationData& ha, LinkState link);
+  void nextPage();
+  void drawChart();
+  int32_t chartScaleFor(uint32_t total) const;
+  void paintChartColumns(TFT_eSPI& g, int16_t ox, int16_t oy, int16_t c0, int16_t c1);
 
 public:
   void begin();
   void showBoot();
-  void render(const PowerwallData& data, const HomeAutomationData& ha, bool isConnected);
+  // The history is fed and drawn by the render task; other tasks read it through copy()
+  void setHistory(PowerHistory* h) { history = h; }
+  void startTask();
+  void publish(const PowerwallData& data, const HomeAutomationData& ha, LinkState link, bool newSample);
+  void requestNextPage();
 };
 
+#endif // DISPLAY_HEADLESS
 #endif // DISPLAY_H
 
 
@@ -0,0 +1,57 @@
+#include "history.h"
+
+static int16_t clampPower(float watts) {
+  if (watts > INT16_MAX) return INT16_MAX;
+  if (watts < INT16_MIN) return INT16_MIN;
+  return (int16_t)lroundf(watts);
+}
+
+void PowerHistory::add(const HomeAutomationData& ha) {
+  if (!ha.valid) return;
+  HistoryBucket b;
+  const float watts[SERIES_COUNT] = { ha.solar_power_w, ha.load_power_w, ha.site_power_w, ha.battery_power_w };
+  for (uint8_t s = 0; s < SERIES_COUNT; s++) b.minW[s] = b.maxW[s] = clampPower(watts[s]);
+  b.socMin = b.socMax = (uint8_t)constrain(lroundf(ha.battery_percent * 2), 0L, 200L);
+  portENTER_CRITICAL(&lock);
+  push(0, b);
+  portEXIT_CRITICAL(&lock);
+}
+
+void PowerHistory::push(uint8_t level, const HistoryBucket& bucket) {
+  Level& l = levels[level];
+  l.ring[l.head] = bucket;
+  l.head = (l.head + 1) % HISTORY_CAPACITY;
+  if (l.count < HISTORY_CAPACITY) l.count++;
+  l.total++;
+
+  if (level + 1 >= HISTORY_LEVELS) return;
+  if (l.pendingCount == 0) l.pending = bucket;
+  else merge(l.pending, bucket);
+  if (++l.pendingCount == HISTORY_FANOUT) {
+    l.pendingCount = 0;
+    push(level + 1, l.pending);
+  }
+}
+
+void PowerHistory::merge(HistoryBucket& into, const HistoryBucket& from) {
+  for (uint8_t s = 0; s < SERIES_COUNT; s++) {
+    into.minW[s] = min(into.minW[s], from.minW[s]);
+    into.maxW[s] = max(into.maxW[s], from.maxW[s]);
+  }
+  into.socMin = min(into.socMin, from.socMin);
+  into.socMax = max(into.socMax, from.socMax);
+}
+
+const HistoryBucket& PowerHistory::at(uint8_t level, uint16_t age) const {
+  const Level& l = levels[level];
+  return l.ring[(l.head + HISTORY_CAPACITY - 1 - age) % HISTORY_CAPACITY];
+}
+
+bool PowerHistory::copy(uint8_t level, uint32_t seq, HistoryBucket& out) const {
+  const Level& l = levels[level];
+  portENTER_CRITICAL(&lock);
+  bool held = seq < l.total && l.total - seq <= l.count;
+  if (held) out = at(level, (uint16_t)(l.total - 1 - seq));
+  portEXIT_CRITICAL(&lock);
+  return held;
+}
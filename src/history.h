@@ -0,0 +1,58 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include "powerwall.h"
+
+// Multi-resolution power/SoC history in fixed memory. Level 0 keeps one bucket per poll;
+// every HISTORY_FANOUT buckets of a level roll up into one min/max bucket of the next.
+// With 20 s polls the defaults span 80 min, 5.3 h and 21 h in 13 KB.
+#ifndef HISTORY_CAPACITY
+#define HISTORY_CAPACITY 240
+#endif
+#ifndef HISTORY_LEVELS
+#define HISTORY_LEVELS 3
+#endif
+#ifndef HISTORY_FANOUT
+#define HISTORY_FANOUT 4
+#endif
+
+enum HistorySeries : uint8_t { SERIES_SOLAR, SERIES_LOAD, SERIES_SITE, SERIES_BATTERY, SERIES_COUNT };
+
+struct HistoryBucket {
+  int16_t minW[SERIES_COUNT];
+  int16_t maxW[SERIES_COUNT];
+  uint8_t socMin; // half-percent steps
+  uint8_t socMax;
+};
+
+class PowerHistory {
+public:
+  void add(const HomeAutomationData& ha);
+  uint16_t size(uint8_t level) const { return levels[level].count; }
+  // Buckets ever completed at this level; the newest has sequence number total - 1
+  uint32_t total(uint8_t level) const { return levels[level].total; }
+  // age 0 is the newest bucket; for the task that calls add()
+  const HistoryBucket& at(uint8_t level, uint16_t age) const;
+  // Bucket by sequence number, safe from any task; false once it has been overwritten
+  bool copy(uint8_t level, uint32_t seq, HistoryBucket& out) const;
+
+private:
+  struct Level {
+    HistoryBucket ring[HISTORY_CAPACITY];
+    uint16_t head = 0;   // next write slot
+    uint16_t count = 0;
+    uint32_t total = 0;
+    HistoryBucket pending;
+    uint8_t pendingCount = 0;
+  };
+
+  void push(uint8_t level, const HistoryBucket& bucket);
+  static void merge(HistoryBucket& into, const HistoryBucket& from);
+
+  Level levels[HISTORY_LEVELS];
+  mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // HISTORY_H
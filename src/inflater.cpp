@@ -0,0 +1,131 @@
+#include "inflater.h"
+#include <esp_rom_crc.h>
+
+// gzip member header flags (RFC 1952)
+static const uint8_t GZIP_FHCRC = 0x02;
+static const uint8_t GZIP_FEXTRA = 0x04;
+static const uint8_t GZIP_FNAME = 0x08;
+static const uint8_t GZIP_FCOMMENT = 0x10;
+
+Inflater::~Inflater() {
+  free(decomp);
+}
+
+bool Inflater::reserve() {
+  if (!decomp) decomp = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+  return decomp != nullptr;
+}
+
+bool Inflater::begin(Format fmt, uint8_t* outBuf, size_t outCapacity) {
+  if (!decomp) { state = STATE_ERROR; return false; }
+  tinfl_init(decomp);
+  format = fmt;
+  out = outBuf;
+  capacity = outCapacity;
+  produced = 0;
+  hdrLen = 0;
+  pendingFlags = 0;
+  skip = 0;
+  zlibWrapped = false;
+  state = STATE_HEADER;
+  return true;
+}
+
+Inflater::Result Inflater::fail(const char* reason) {
+  Serial.printf("Inflate failed: %s\n", reason);
+  state = STATE_ERROR;
+  return INFLATE_ERROR;
+}
+
+void Inflater::nextHeaderField() {
+  hdrLen = 0;
+  if (pendingFlags & GZIP_FEXTRA) { pendingFlags &= ~GZIP_FEXTRA; state = STATE_EXTRA_LEN; }
+  else if (pendingFlags & GZIP_FNAME) { pendingFlags &= ~GZIP_FNAME; state = STATE_ZSTRING; }
+  else if (pendingFlags & GZIP_FCOMMENT) { pendingFlags &= ~GZIP_FCOMMENT; state = STATE_ZSTRING; }
+  else if (pendingFlags & GZIP_FHCRC) { pendingFlags &= ~GZIP_FHCRC; skip = 2; state = STATE_SKIP; }
+  else state = STATE_BODY;
+}
+
+size_t Inflater::inflateBody(const uint8_t* data, size_t len) {
+  size_t inSize = len;
+  size_t outSize = capacity - produced;
+  mz_uint32 flags = TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF;
+  if (zlibWrapped) flags |= TINFL_FLAG_PARSE_ZLIB_HEADER;
+  tinfl_status status = tinfl_decompress(decomp, data, &inSize, out, out + produced, &outSize, flags);
+  produced += outSize;
+  if (status == TINFL_STATUS_DONE) {
+    state = (format == FORMAT_GZIP) ? STATE_TRAILER : STATE_DONE;
+    hdrLen = 0;
+  } else if (status == TINFL_STATUS_HAS_MORE_OUTPUT) {
+    fail("output buffer full");
+  } else if (status < 0) {
+    fail("corrupt stream");
+  }
+  return inSize;
+}
+
+Inflater::Result Inflater::feed(const uint8_t* data, size_t len) {
+  while (len > 0) {
+    switch (state) {
+      case STATE_HEADER:
+        hdr[hdrLen++] = *data++; len--;
+        if (format == FORMAT_GZIP) {
+          if (hdrLen < 10) break;
+          if (hdr[0] != 0x1F || hdr[1] != 0x8B || hdr[2] != 8) return fail("bad gzip header");
+          pendingFlags = hdr[3];
+          nextHeaderField();
+        } else {
+          // HTTP "deflate" is zlib-wrapped per RFC 9110, but some servers send raw deflate
+          if (hdrLen < 2) break;
+          // Same checks tinfl applies to a zlib header: deflate method, window <= 32 KB, no preset dictionary
+          zlibWrapped = (hdr[0] & 0x0F) == 8 && (hdr[0] >> 4) <= 7 && !(hdr[1] & 0x20) && ((hdr[0] << 8) | hdr[1]) % 31 == 0;
+          state = STATE_BODY;
+          size_t used = inflateBody(hdr, 2);
+          if (state == STATE_ERROR) return INFLATE_ERROR;
+          if (used < 2 && state == STATE_BODY) return fail("deflate header not consumed");
+        }
+        break;
+      case STATE_EXTRA_LEN:
+        hdr[hdrLen++] = *data++; len--;
+        if (hdrLen < 2) break;
+        skip = (uint16_t)(hdr[0] | (hdr[1] << 8));
+        if (skip == 0) nextHeaderField(); else state = STATE_SKIP;
+        break;
+      case STATE_SKIP: {
+        size_t n = min<size_t>(skip, len);
+        data += n; len -= n; skip -= n;
+        if (skip == 0) nextHeaderField();
+        break;
+      }
+      case STATE_ZSTRING: {
+        uint8_t c = *data++; len--;
+        if (c == 0) nextHeaderField();
+        break;
+      }
+      case STATE_BODY: {
+        size_t used = inflateBody(data, len);
+        if (state == STATE_ERROR) return INFLATE_ERROR;
+        if (used == 0 && state == STATE_BODY) return fail("stalled");
+        data += used; len -= used;
+        break;
+      }
+      case STATE_TRAILER: {
+        hdr[hdrLen++] = *data++; len--;
+        if (hdrLen < 8) break;
+        uint32_t crc = (uint32_t)hdr[0] | ((uint32_t)hdr[1] << 8) | ((uint32_t)hdr[2] << 16) | ((uint32_t)hdr[3] << 24);
+        uint32_t isize = (uint32_t)hdr[4] | ((uint32_t)hdr[5] << 8) | ((uint32_t)hdr[6] << 16) | ((uint32_t)hdr[7] << 24);
+        if (isize != (uint32_t)produced) return fail("length mismatch");
+        if (esp_rom_crc32_le(0, out, produced) != crc) return fail("crc mismatch");
+        state = STATE_DONE;
+        break;
+      }
+      case STATE_DONE:
+        // Trailing bytes after the end of the stream are ignored
+        return INFLATE_DONE;
+      case STATE_ERROR:
+        return INFLATE_ERROR;
+    }
+  }
+  if (state == STATE_ERROR) return INFLATE_ERROR;
+  return state == STATE_DONE ? INFLATE_DONE : INFLATE_MORE;
+}
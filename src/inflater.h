@@ -0,0 +1,51 @@
+#ifndef INFLATER_H
+#define INFLATER_H
+
+#include <Arduino.h>
+
+#if defined(CONFIG_IDF_TARGET_ESP32S3)
+#include "esp32s3/rom/miniz.h"
+#elif defined(CONFIG_IDF_TARGET_ESP32C3)
+#include "esp32c3/rom/miniz.h"
+#else
+#include "esp32/rom/miniz.h"
+#endif
+
+// Incremental gzip / zlib / raw deflate decoder built on the ROM tinfl.
+// Compressed bytes are fed as they arrive from the socket; output goes straight into the
+// caller's response buffer, which also serves as the back-reference window, so no separate
+// dictionary or compressed copy of the body is kept.
+class Inflater {
+public:
+  enum Format { FORMAT_GZIP, FORMAT_DEFLATE };
+  enum Result { INFLATE_MORE, INFLATE_DONE, INFLATE_ERROR };
+
+  ~Inflater();
+  // Allocates the decompressor state; called once at boot so begin() never touches the heap
+  bool reserve();
+  bool begin(Format format, uint8_t* out, size_t capacity);
+  Result feed(const uint8_t* data, size_t len);
+  bool finished() const { return state == STATE_DONE; }
+  size_t outputLength() const { return produced; }
+
+private:
+  enum State { STATE_HEADER, STATE_EXTRA_LEN, STATE_SKIP, STATE_ZSTRING, STATE_BODY, STATE_TRAILER, STATE_DONE, STATE_ERROR };
+
+  void nextHeaderField();
+  size_t inflateBody(const uint8_t* data, size_t len);
+  Result fail(const char* reason);
+
+  tinfl_decompressor* decomp = nullptr; // ~11 KB, allocated by reserve() and kept
+  Format format = FORMAT_GZIP;
+  State state = STATE_DONE;
+  uint8_t* out = nullptr;
+  size_t capacity = 0;
+  size_t produced = 0;
+  uint8_t hdr[10];
+  uint8_t hdrLen = 0;
+  uint8_t pendingFlags = 0;
+  uint16_t skip = 0;
+  bool zlibWrapped = false;
+};
+
+#endif // INFLATER_H
@@ -0,0 +1,49 @@
+#include "latency_stats.h"
+
+static const uint8_t FIRST_OCTAVE = 7; // bucket 0 holds everything below 128 us
+
+static const char *const STAGE_NAMES[STAGE_COUNT] = {
+  "tcp connect", "tls handshake", "write", "first byte", "body read", "protobuf", "json"
+};
+
+static uint8_t bucketFor(uint32_t us) {
+  if (us < (1UL << FIRST_OCTAVE)) return 0;
+  uint8_t msb = 31 - __builtin_clz(us);
+  uint32_t index = 1 + (uint32_t)(msb - FIRST_OCTAVE) * 2 + ((us >> (msb - 1)) & 1);
+  return index < LatencyStats::BUCKETS ? (uint8_t)index : LatencyStats::BUCKETS - 1;
+}
+
+static uint32_t bucketUpperUs(uint8_t bucket) {
+  if (bucket == 0) return 1UL << FIRST_OCTAVE;
+  uint8_t octave = FIRST_OCTAVE + (bucket - 1) / 2;
+  return (1UL << octave) + ((bucket - 1) % 2 + 1) * (1UL << (octave - 1));
+}
+
+void LatencyStats::record(PollStage stage, uint32_t us) {
+  Histogram &h = stages[stage];
+  h.buckets[bucketFor(us)]++;
+  if (h.count == 0 || us < h.minUs) h.minUs = us;
+  if (us > h.maxUs) h.maxUs = us;
+  h.count++;
+}
+
+uint32_t LatencyStats::percentileUs(PollStage stage, uint8_t pct) const {
+  const Histogram &h = stages[stage];
+  if (h.count == 0) return 0;
+  uint32_t rank = (uint32_t)(((uint64_t)h.count * pct + 99) / 100);
+  uint32_t seen = 0;
+  for (uint8_t b = 0; b < BUCKETS; b++) {
+    seen += h.buckets[b];
+    if (seen >= rank) return b == BUCKETS - 1 ? h.maxUs : min(bucketUpperUs(b), h.maxUs);
+  }
+  return h.maxUs;
+}
+
+void LatencyStats::printTo(Print &out) const {
+  out.println("[Latency] stage            n     min ms     p99 ms     max ms");
+  for (uint8_t s = 0; s < STAGE_COUNT; s++) {
+    const Histogram &h = stages[s];
+    out.printf("[Latency] %-13s %6lu %10.1f %10.1f %10.1f\n", STAGE_NAMES[s], (unsigned long)h.count,
+               h.minUs / 1000.0, percentileUs((PollStage)s, 99) / 1000.0, h.maxUs / 1000.0);
+  }
+}
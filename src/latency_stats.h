@@ -0,0 +1,42 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <Arduino.h>
+
+// Stages of one TEDAPI exchange, in the order they happen
+enum PollStage : uint8_t {
+  STAGE_CONNECT,      // TCP connect
+  STAGE_HANDSHAKE,    // TLS handshake, including session resumption
+  STAGE_WRITE,        // request header and body
+  STAGE_FIRST_BYTE,   // start of the response read -> first byte (pipelined: after the previous response)
+  STAGE_BODY_READ,    // first byte -> body complete, including inflate
+  STAGE_PROTOBUF,     // recv.text extraction from the protobuf reply
+  STAGE_JSON,         // filtered JSON parse
+  STAGE_COUNT
+};
+
+// Per-stage latency histograms in fixed memory: two buckets per power of two from 128 us to
+// 16 s, so p99 is known to within 50 %; min and max are exact. Recording is one micros()
+// difference and a counter increment.
+class LatencyStats {
+public:
+  static const uint8_t BUCKETS = 35;
+
+  void record(PollStage stage, uint32_t us);
+  // Upper bound of the bucket holding the pct-th percentile, capped at the largest sample
+  uint32_t percentileUs(PollStage stage, uint8_t pct) const;
+  // One line per stage; any Print works as a sink (Serial, a TCP client)
+  void printTo(Print &out) const;
+
+private:
+  struct Histogram {
+    uint32_t buckets[BUCKETS];
+    uint32_t count;
+    uint32_t minUs;
+    uint32_t maxUs;
+  };
+
+  Histogram stages[STAGE_COUNT] = {};
+};
+
+#endif // LATENCY_STATS_H
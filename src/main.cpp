@@ -1,12 +1,29 @@
 #include <Arduino.h>
+#include <esp_heap_caps.h>
 #include "powerwall.h"
 #include "config.h"
 #include "display.h"
 #include "bthome.h"
+#include "telemetry_gatt.h"
+
+// T-Display right-hand button switches between the summary and history pages
+#ifndef DISPLAY_PAGE_BUTTON
+#define DISPLAY_PAGE_BUTTON 35
+#endif
+// Poll cadence; polls are scheduled on fixed ticks so the TLS session can be opened ahead of them
+#ifndef POLL_INTERVAL_MS
+#define POLL_INTERVAL_MS 20000
+#endif
 
 Powerwall* powerwall;
 Display* displayUI;
 BTHomeAdvertiser* bthome;
+#ifndef DISPLAY_HEADLESS
+PowerHistory history;
+#endif
+#if TELEMETRY_GATT
+TelemetryGatt* telemetryGatt;
+#endif
 
 void setup() {
   Serial.begin(115200);
@@ -16,30 +33,65 @@ void setup() {
 
   displayUI = new Display();
   displayUI->begin();
+#ifndef DISPLAY_HEADLESS
+  displayUI->setHistory(&history);
+  pinMode(DISPLAY_PAGE_BUTTON, INPUT);
+#endif
   displayUI->showBoot();
+  displayUI->startTask();
 
   bthome = new BTHomeAdvertiser();
+#ifdef BTHOME_BIND_KEY
+  bthome->begin("PW BTHome", BTHOME_BIND_KEY);
+#else
   bthome->begin("PW BTHome");
+#endif
+#if TELEMETRY_GATT
+  telemetryGatt = new TelemetryGatt();
+#ifndef DISPLAY_HEADLESS
+  telemetryGatt->begin(&history);
+#else
+  telemetryGatt->begin(nullptr);
+#endif
+  bthome->setConnectable(true);
+#endif
 
-  Serial.println("=== SETUP COMPLETE ===");
+  // Image size and heap left after setup, for comparing the default and headless envs on hardware
+  Serial.printf("=== SETUP COMPLETE (%lu ms, image %u bytes, free heap %u bytes) ===\n", millis(),
+                (unsigned)ESP.getSketchSize(), (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT));
 }
 
 void loop() {
-  static unsigned long lastDebug = 0;
-  
-  // Debug output
-  if (lastDebug == 0 || millis() - lastDebug > 20000) {
+  static unsigned long pollDueMs = 0;
+  static bool prewarmed = false;
+  static LinkState lastLink = LINK_OFFLINE;
+  static uint8_t warmPolls = 0;
+
+  long untilPoll = (long)(pollDueMs - millis());
+  if (!prewarmed && untilPoll > 0 && untilPoll <= TEDAPI_PREWARM_MS) {
+    powerwall->prewarm();
+    prewarmed = true;
+  }
+  if (untilPoll <= 0) {
     Serial.println("Loop running...");
+    // After warm-up the poll must not touch the heap (checked with POLL_ALLOC_CHECK=1)
+    AllocGuard guard(warmPolls >= POLL_ALLOC_WARMUP_POLLS);
+    powerwall->memoryStats().sample(MEM_IDLE);
 
-    if (powerwall->fetchBatteryLevel()) {
+    bool fetched = powerwall->fetchBatteryLevel();
+    if (fetched) {
+      if (warmPolls < POLL_ALLOC_WARMUP_POLLS) warmPolls++;
       Serial.println("Successfully fetched battery data");
     } else {
       Serial.println("Failed to fetch battery data");
     }
     powerwall->printBatteryLevel();
+    LinkState link = powerwall->linkState();
     if (displayUI) {
-      displayUI->render(powerwall->getData(), powerwall->getHomeData(), powerwall->isConnected());
+      displayUI->publish(powerwall->getData(), powerwall->getHomeData(), link, fetched);
     }
+    lastLink = link;
+    if (bthome) bthome->updateLink(link == LINK_ONLINE);
     // Publish BTHome battery percent + solar power if valid
     HomeAutomationData ha = powerwall->getHomeData();
     if (ha.valid && bthome) {
@@ -50,12 +102,73 @@ void loop() {
       int32_t battW = (int32_t)ha.battery_power_w;
       bool grid = ha.grid_connected;
       bthome->updateBatteryAndPowers(pct, solarW, loadW, battW, siteW, grid);
+      bthome->updateDetails(ha.battery_wh_remaining, ha.grid_voltage_v, 3, ha.alert_count);
+      // Per-block frame only when every block reported, so entity indices stay stable
+      uint8_t blockPct[MAX_BATTERY_BLOCKS];
+      uint8_t blockCount = ha.block_count;
+      for (uint8_t i = 0; i < ha.block_count; i++) {
+        if (!ha.blocks[i].valid) { blockCount = 0; break; }
+        float p = ha.blocks[i].battery_percent;
+        blockPct[i] = (p < 0) ? 0 : (p > 100 ? 100 : (uint8_t)p);
+      }
+      bthome->updateBlocks(blockPct, blockCount);
+    }
+#if TELEMETRY_GATT
+    if (fetched && telemetryGatt) telemetryGatt->publish(ha, link == LINK_ONLINE);
+#endif
+    powerwall->memoryStats().sample(MEM_PUBLISHED);
+    // Stay on the tick grid unless the poll overran a whole interval
+    pollDueMs += POLL_INTERVAL_MS;
+    if ((long)(pollDueMs - millis()) <= 0) pollDueMs = millis() + POLL_INTERVAL_MS;
+    prewarmed = false;
+  }
+
+#ifndef DISPLAY_HEADLESS
+  // Button is active low; act on the press edge once it has been stable for 50 ms
+  static int lastButton = HIGH;
+  static unsigned long buttonChangedMs = 0;
+  static bool pressHandled = false;
+  int button = digitalRead(DISPLAY_PAGE_BUTTON);
+  if (button != lastButton) {
+    lastButton = button;
+    buttonChangedMs = millis();
+    pressHandled = false;
+  } else if (button == LOW && !pressHandled && millis() - buttonChangedMs > 50) {
+    pressHandled = true;
+    if (displayUI) displayUI->requestNextPage();
+  }
+#endif
+
+  // Serial console: 'l' prints per-stage poll latency and request records, 'm' heap and stack usage,
+  // 't' benchmarks the TLS handshake, 'c' BTHome packet encryption
+  if (Serial.available()) {
+    int cmd = Serial.read();
+    if (cmd == 'l') {
+      powerwall->latencyStats().printTo(Serial);
+      powerwall->recordWriter().printTo(Serial);
+    } else if (cmd == 'm') {
+      powerwall->memoryStats().printTo(Serial);
+      powerwall->pollArena().printTo(Serial);
+    } else if (cmd == 't') {
+      powerwall->benchmarkTls(Serial, 5);
+    } else if (cmd == 'c') {
+      bthome->benchmarkCipher(Serial);
     }
-    lastDebug = millis();
   }
 
   // Continuous maintenance (WiFi/DIN)
   powerwall->maintain();
-  // BLE advertiser frame alternation at ~1Hz
+  // Link changes between polls (WiFi drop, DIN recovered) reach the screen right away
+  LinkState link = powerwall->linkState();
+  if (link != lastLink) {
+    lastLink = link;
+    if (displayUI) displayUI->publish(powerwall->getData(), powerwall->getHomeData(), link, false);
+  }
+  // BLE advertiser frame rotation and burst/idle interval
   if (bthome) bthome->tick();
+#if TELEMETRY_GATT
+  if (telemetryGatt) telemetryGatt->tick();
+#endif
+  // loopTask never blocks between polls; one tick lets the lower-priority render task on this core run
+  delay(1);
 }
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include "memory_stats.h"
+#include <esp_heap_caps.h>
+#include <freertos/task.h>
+
+static const char *const PHASE_NAMES[MEM_PHASE_COUNT] = { "idle", "connected", "response", "parsed", "published" };
+// Tasks whose stacks are reported; ones that do not exist in this build are skipped
+static const char *const WATCHED_TASKS[] = { "loopTask", "display", "nimble_host", "tiT", "wifi" };
+
+void MemoryStats::sample(MemPhase phase) {
+  uint32_t freeBytes = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  uint32_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  PhaseStats &p = phases[phase];
+  if (p.samples == 0 || freeBytes < p.minFree) p.minFree = freeBytes;
+  if (p.samples == 0 || largest < p.minLargest) p.minLargest = largest;
+  p.freeBytes = freeBytes;
+  p.largestBlock = largest;
+  p.stackFree = uxTaskGetStackHighWaterMark(nullptr);
+  p.samples++;
+
+  if (currentSamples == 0) periodStartMs = millis();
+  if (currentSamples == 0 || freeBytes < current.minFree) current.minFree = freeBytes;
+  if (currentSamples == 0 || largest < current.minLargest) current.minLargest = largest;
+  currentSamples++;
+  if (millis() - periodStartMs >= MEMORY_TREND_PERIOD_MS) closePeriod();
+}
+
+void MemoryStats::closePeriod() {
+  trend[trendHead] = current;
+  trendHead = (trendHead + 1) % MEMORY_TREND_POINTS;
+  if (trendCount < MEMORY_TREND_POINTS) trendCount++;
+  periods++;
+  currentSamples = 0;
+  uint32_t fragPct = current.minFree ? 100 - (uint32_t)((uint64_t)current.minLargest * 100 / current.minFree) : 0;
+  // Formatted locally: Print::printf would allocate for a line this long in the middle of a poll
+  char line[160];
+  snprintf(line, sizeof(line), "[Memory] period %lu: min free %lu, min largest block %lu (%lu%% fragmented), min ever %u; largest block %+.0f B/day",
+           (unsigned long)periods, (unsigned long)current.minFree, (unsigned long)current.minLargest,
+           (unsigned long)fragPct, (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT), largestSlopePerDay());
+  Serial.println(line);
+}
+
+float MemoryStats::largestSlopePerDay() const {
+  // Least-squares slope over the held points, oldest first
+  if (trendCount < 2) return 0;
+  float n = trendCount, sumX = 0, sumY = 0, sumXY = 0, sumXX = 0;
+  for (uint16_t i = 0; i < trendCount; i++) {
+    const TrendPoint &t = trend[(trendHead + MEMORY_TREND_POINTS - trendCount + i) % MEMORY_TREND_POINTS];
+    sumX += i;
+    sumY += t.minLargest;
+    sumXY += i * (float)t.minLargest;
+    sumXX += (float)i * i;
+  }
+  float slopePerPeriod = (n * sumXY - sumX * sumY) / (n * sumXX - sumX * sumX);
+  return slopePerPeriod * (86400000.0f / MEMORY_TREND_PERIOD_MS);
+}
+
+void MemoryStats::printTo(Print &out) const {
+  out.printf("[Memory] free %u, largest block %u, min ever %u\n", (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+             (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT), (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+  out.println("[Memory] phase          free   largest  min free  min largest  loop stack free");
+  for (uint8_t i = 0; i < MEM_PHASE_COUNT; i++) {
+    const PhaseStats &p = phases[i];
+    if (p.samples == 0) continue;
+    out.printf("[Memory] %-10s %8lu %9lu %9lu %12lu %16lu\n", PHASE_NAMES[i], (unsigned long)p.freeBytes,
+               (unsigned long)p.largestBlock, (unsigned long)p.minFree, (unsigned long)p.minLargest, (unsigned long)p.stackFree);
+  }
+  for (const char *name : WATCHED_TASKS) {
+    TaskHandle_t task = xTaskGetHandle(name);
+    if (task) out.printf("[Memory] task %-12s stack free %u\n", name, (unsigned)uxTaskGetStackHighWaterMark(task));
+  }
+  out.printf("[Memory] trend (%u periods of %lu min, oldest first), largest block %+.0f B/day:\n", trendCount,
+             (unsigned long)(MEMORY_TREND_PERIOD_MS / 60000), largestSlopePerDay());
+  for (uint16_t i = 0; i < trendCount; i++) {
+    const TrendPoint &t = trend[(trendHead + MEMORY_TREND_POINTS - trendCount + i) % MEMORY_TREND_POINTS];
+    out.printf("[Memory]   %lu / %lu\n", (unsigned long)t.minFree, (unsigned long)t.minLargest);
+  }
+}
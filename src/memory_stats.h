@@ -0,0 +1,60 @@
+#ifndef MEMORY_STATS_H
+#define MEMORY_STATS_H
+
+#include <Arduino.h>
+
+// One trend point per period: the lowest free heap and largest free block seen in it
+#ifndef MEMORY_TREND_PERIOD_MS
+#define MEMORY_TREND_PERIOD_MS 3600000UL
+#endif
+#ifndef MEMORY_TREND_POINTS
+#define MEMORY_TREND_POINTS 48
+#endif
+
+// Points in the poll cycle where the heap is sampled
+enum MemPhase : uint8_t {
+  MEM_IDLE,        // before the poll
+  MEM_CONNECTED,   // TLS session set up
+  MEM_RESPONSE,    // response body read
+  MEM_PARSED,      // status JSON parsed
+  MEM_PUBLISHED,   // display and BLE sinks updated
+  MEM_PHASE_COUNT
+};
+
+// Free heap, largest free block and the calling task's stack high-water mark per poll phase,
+// with an hourly trend of the worst values. A largest block that keeps shrinking while free
+// heap holds steady is fragmentation; the trend line reports its slope per day.
+class MemoryStats {
+public:
+  // Call from the poll loop task; its stack high-water mark is recorded with the heap
+  void sample(MemPhase phase);
+  void printTo(Print &out) const;
+
+private:
+  struct PhaseStats {
+    uint32_t samples;
+    uint32_t freeBytes;
+    uint32_t largestBlock;
+    uint32_t minFree;
+    uint32_t minLargest;
+    uint32_t stackFree;
+  };
+  struct TrendPoint {
+    uint32_t minFree;
+    uint32_t minLargest;
+  };
+
+  void closePeriod();
+  float largestSlopePerDay() const;
+
+  PhaseStats phases[MEM_PHASE_COUNT] = {};
+  TrendPoint trend[MEMORY_TREND_POINTS] = {};
+  uint16_t trendHead = 0;
+  uint16_t trendCount = 0;
+  uint32_t periods = 0;
+  TrendPoint current = {};
+  uint32_t currentSamples = 0;
+  unsigned long periodStartMs = 0;
+};
+
+#endif // MEMORY_STATS_H
@@ -0,0 +1,71 @@
+#include "poll_arena.h"
+#if POLL_ALLOC_CHECK
+#include <freertos/task.h>
+#include <esp_rom_sys.h>
+#endif
+
+bool PollArena::begin(size_t capacityArg) {
+  if (base) return true;
+  base = (uint8_t*)malloc(capacityArg);
+  if (!base) {
+    Serial.println("[Arena] Allocation failed");
+    return false;
+  }
+  capacity = capacityArg;
+  return true;
+}
+
+void* PollArena::alloc(size_t size) {
+  size_t start = (used + 3) & ~(size_t)3;
+  if (!base || start + size > capacity) {
+    failures++;
+    Serial.printf("[Arena] Exhausted (%u bytes requested)\n", (unsigned)size);
+    return nullptr;
+  }
+  used = start + size;
+  if (used > highWater) highWater = used;
+  return base + start;
+}
+
+void PollArena::printTo(Print& out) const {
+  out.printf("[Arena] high water %u of %u bytes, %lu failed allocations\n", (unsigned)highWater, (unsigned)capacity,
+             (unsigned long)failures);
+}
+
+#if POLL_ALLOC_CHECK
+static volatile TaskHandle_t guardedTask = nullptr;
+static volatile uint8_t exemptDepth = 0;
+
+AllocGuard::AllocGuard(bool armed) { guardedTask = armed ? xTaskGetCurrentTaskHandle() : nullptr; }
+AllocGuard::~AllocGuard() { guardedTask = nullptr; }
+AllocGuard::Exempt::Exempt() { exemptDepth++; }
+AllocGuard::Exempt::~Exempt() { exemptDepth--; }
+
+static void checkAllocation(size_t size, void* caller) {
+  if (!guardedTask || exemptDepth || xTaskGetCurrentTaskHandle() != guardedTask) return;
+  // Serial may allocate; the ROM printf does not
+  esp_rom_printf("\n[AllocGuard] %u-byte heap allocation in the steady-state poll from %p\n", (unsigned)size, caller);
+  abort();
+}
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  checkAllocation(size, __builtin_return_address(0));
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  checkAllocation(count * size, __builtin_return_address(0));
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  checkAllocation(size, __builtin_return_address(0));
+  return __real_realloc(ptr, size);
+}
+}
+#endif
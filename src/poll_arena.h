@@ -0,0 +1,80 @@
+#ifndef POLL_ARENA_H
+#define POLL_ARENA_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Scratch memory for one poll: request header, response header and JSON documents
+#ifndef POLL_ARENA_SIZE
+#define POLL_ARENA_SIZE 12288
+#endif
+// Successful polls before the allocation check arms (config, DIN, block discovery, BLE setup)
+#ifndef POLL_ALLOC_WARMUP_POLLS
+#define POLL_ALLOC_WARMUP_POLLS 3
+#endif
+
+// Bump allocator over one block taken at boot. Allocations are released in LIFO order by
+// ArenaScope, so a poll leaves the arena empty and never touches the general heap.
+class PollArena {
+public:
+  bool begin(size_t capacity);
+  // 4-byte aligned; nullptr when the arena is exhausted
+  void* alloc(size_t size);
+  size_t mark() const { return used; }
+  void release(size_t markArg) { if (markArg < used) used = markArg; }
+  void printTo(Print& out) const;
+
+private:
+  uint8_t* base = nullptr;
+  size_t capacity = 0;
+  size_t used = 0;
+  size_t highWater = 0;
+  uint32_t failures = 0;
+};
+
+// Returns everything allocated in its lifetime to the arena
+class ArenaScope {
+public:
+  explicit ArenaScope(PollArena& arena) : arena(arena), start(arena.mark()) {}
+  ~ArenaScope() { arena.release(start); }
+
+private:
+  PollArena& arena;
+  size_t start;
+};
+
+// ArduinoJson allocator that draws document pools from the arena; freeing is left to ArenaScope
+struct ArenaJsonAllocator {
+  explicit ArenaJsonAllocator(PollArena* arena = nullptr) : arena(arena) {}
+  void* allocate(size_t size) { return arena ? arena->alloc(size) : nullptr; }
+  void deallocate(void*) {}
+  void* reallocate(void*, size_t) { return nullptr; }
+
+  PollArena* arena;
+};
+typedef BasicJsonDocument<ArenaJsonAllocator> ArenaJsonDocument;
+
+// Debug check for the allocation-free poll. Build with -DPOLL_ALLOC_CHECK=1 and the
+// malloc/calloc/realloc linker wraps (env lilygo-t-display-alloc-check); an allocation from the
+// poll task while a guard is armed then aborts with the size and caller. Transport setup that
+// allocates by design (TLS handshake) runs under an exemption.
+class AllocGuard {
+public:
+#if POLL_ALLOC_CHECK
+  explicit AllocGuard(bool armed);
+  ~AllocGuard();
+  class Exempt {
+  public:
+    Exempt();
+    ~Exempt();
+  };
+#else
+  explicit AllocGuard(bool) {}
+  class Exempt {
+  public:
+    Exempt() {}
+  };
+#endif
+};
+
+#endif // POLL_ARENA_H
@@ -1,22 +1,40 @@
 #include "powerwall.h"
+#include "config.h"
 #include <vector>
+#include <stdarg.h>
+#include <esp_heap_caps.h>
 
 // Forward declaration for varint encoder used below
 static size_t encodeVarint(uint8_t* buffer, uint32_t value);
 // Forward declarations for protobuf readers used before their definitions
-static String extractRecvTextFromQueryType(const uint8_t* p, const uint8_t* end);
-static String extractRecvTextFromMessage(const uint8_t* p, const uint8_t* end);
-static bool extractConfigCodeFromMessage(const uint8_t* p, const uint8_t* end, std::vector<uint8_t>& outCode);
+static bool extractRecvTextFromQueryType(const uint8_t* p, const uint8_t* end, const char** text, size_t* len);
+static bool extractRecvTextFromMessage(const uint8_t* p, const uint8_t* end, const char** text, size_t* len);
+static bool extractConfigCodeFromMessage(const uint8_t* p, const uint8_t* end, const uint8_t*& outCode, size_t& outLen);
+
+// Print::printf allocates for lines over 64 characters; long per-poll lines are formatted here instead
+static void logLine(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static void logLine(const char* fmt, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  Serial.println(line);
+}
 
 Powerwall::Powerwall(const char* wifiSSID, const char* gatewayPassword) {
   ssid = wifiSSID;
   gw_pwd = gatewayPassword;
   wifiBackoffMs = 0;
+  // Gateway accepts Basic auth for TEDAPI posts on some firmwares; include it to avoid 403
+  if (!requestHeader.begin(TEDAPI_HOST, "Tesla_Energy_Device", gw_pwd, TEDAPI_ACCEPT_ENCODING)) {
+    Serial.println("TEDAPI request header does not fit; check the gateway password length");
+  }
 }
 
 bool Powerwall::begin() {
   Serial.println("Initializing Powerwall TEDAPI connection...");
-  if (!connectToWiFi()) {
+  if (!connectToWiFi(Deadline(WIFI_CONNECT_TIMEOUT_MS))) {
     return false;
   }
   return connectTEDAPI();
@@ -34,7 +52,7 @@ void Powerwall::maintain() {
       // Try a reconnect sequence
       WiFi.disconnect(true);
       delay(50);
-      connectToWiFi();
+      connectToWiFi(Deadline(WIFI_CONNECT_TIMEOUT_MS));
       // Update backoff
       if (WiFi.status() == WL_CONNECTED) {
         wifiBackoffMs = 0;
@@ -51,33 +69,28 @@ void Powerwall::maintain() {
   // Ensure DIN is available once per boot or if cleared
   if (din.isEmpty()) {
     // Avoid tight loop on DIN fetch
-    if (now - lastDINFetchMs > 10000) {
+    if (now - lastDINFetchMs > 10000 && breaker.allowRequest()) {
       lastDINFetchMs = now;
-      connectTEDAPI();
+      recordOutcome(connectTEDAPI());
     }
   }
 }
 
-bool Powerwall::connectToWiFi() {
+bool Powerwall::connectToWiFi(const Deadline& deadline) {
   Serial.printf("Connecting to Powerwall WiFi: %s\n", ssid);
   
   WiFi.begin(ssid, gw_pwd);
   
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-    delay(500);
-    Serial.print(".");
-    attempts++;
-  }
+  // Block on the event group until DHCP completes rather than polling the status
+  WiFi.waitStatusBits(STA_HAS_IP_BIT, deadline.remaining());
   
   if (WiFi.status() == WL_CONNECTED) {
     wifiConnected = true;
-    Serial.println();
     Serial.printf("WiFi connected! IP: %s\n", WiFi.localIP().toString().c_str());
     return true;
   } else {
     wifiConnected = false;
-    Serial.println("\nFailed to connect to WiFi");
+    Serial.println("Failed to connect to WiFi");
     return false;
   }
 }
@@ -85,10 +98,12 @@ bool Powerwall::connectToWiFi() {
 bool Powerwall::connectTEDAPI() {
   Serial.println("Connecting to TEDAPI...");
   
-  client.setInsecure();
+  pollBudget = Deadline(TEDAPI_POLL_BUDGET_MS);
+  lastFailure = FAILURE_NONE;
   
-  if (!client.connect(TEDAPI_HOST, TEDAPI_PORT)) {
+  if (!connectClient()) {
     Serial.println("Failed to connect to TEDAPI host");
+    lastFailure = FAILURE_TRANSPORT;
     return false;
   }
   
@@ -110,183 +125,412 @@ bool Powerwall::connectTEDAPI() {
 
 bool Powerwall::getDIN() {
   Serial.println("Fetching DIN from TEDAPI...");
-  
-  // Create Basic Auth header: base64("Tesla_Energy_Device:gateway_password")
-  String auth = "Tesla_Energy_Device:" + String(gw_pwd);
-  String authEncoded = base64::encode(auth);
-  
-  String request = String("GET /tedapi/din HTTP/1.1\r\n") +
-                  "Host: " + TEDAPI_HOST + "\r\n" +
-                  "Authorization: Basic " + authEncoded + "\r\n" +
-                  "Connection: keep-alive\r\n\r\n";
-  
-  client.print(request);
-  
-  // Read response
-  unsigned long timeout = millis() + TEDAPI_TIMEOUT;
-  String response = "";
-  
-  while (millis() < timeout) {
-    if (client.available()) {
-      response += client.readString();
-      break;
-    }
-    delay(10);
-  }
-  
-  // Read DIN response; avoid logging full headers
-  
-  // Extract DIN from response body
-  int bodyStart = response.indexOf("\r\n\r\n");
-  if (bodyStart >= 0) {
-    din = response.substring(bodyStart + 4);
-    din.trim();
-    if (din.length() > 0) {
-      Serial.printf("Got DIN: %s\n", din.c_str());
-      return true;
-    }
+
+  TedapiRequest req;
+  snprintf(req.path, sizeof(req.path), "/tedapi/din");
+  req.handle = [this](const uint8_t* data, size_t len) {
+    // Extract DIN from response body
+    String body;
+    body.reserve(len);
+    for (size_t i = 0; i < len; i++) body += (char)data[i];
+    body.trim();
+    din = body;
+    return din.length() > 0;
+  };
+  // Leave the connection open so the first poll can reuse it
+  if (sendBatch(&req, 1, true) && din.length() > 0) {
+    Serial.printf("Got DIN: %s\n", din.c_str());
+    return true;
   }
-  
+
   Serial.println("Failed to extract DIN from response");
   return false;
 }
 
-bool Powerwall::sendProtobufRequest(const uint8_t* data, size_t len, uint8_t* response, size_t responseCapacity, size_t* responseLen) {
-  return sendProtobufRequestTo("/tedapi/v1", data, len, response, responseCapacity, responseLen);
+bool Powerwall::sendBatch(TedapiRequest* requests, size_t count, bool holdOpen) {
+  ensureBuffers();
+  bool allHandled = true;
+  size_t next = 0; // first request whose response has not been consumed
+  while (next < count) {
+    if (stageTimeout(TEDAPI_TIMEOUT) == 0) {
+      Serial.println("TEDAPI poll budget exhausted");
+      client.stop();
+      lastFailure = FAILURE_TRANSPORT;
+      return false;
+    }
+    bool reused = client.connected();
+    if (!reused) {
+      if (!connectClient()) {
+        Serial.println("Failed to connect to TEDAPI");
+        lastFailure = FAILURE_TRANSPORT;
+        return false;
+      }
+    }
+
+    // Pipeline the rest of the batch when the gateway allows it, otherwise one request per round-trip
+    size_t end = pipelineRequests ? count : next + 1;
+    size_t written = next;
+    Deadline writeDeadline = pollBudget.capped(TEDAPI_TIMEOUT);
+    RecordWriter::Counters sentBefore = requestWriter.counters();
+    uint32_t writeStartUs = micros();
+    for (; written < end; written++) {
+      bool keepAlive = holdOpen || written + 1 < count;
+      if (!writeTedapiRequest(requests[written], keepAlive, writeDeadline)) break;
+    }
+    // Requests only share records within one window; the tail is sent before waiting on a response
+    if (written > next && !requestWriter.flush(writeDeadline)) written = next;
+    requestSentMs = millis();
+    if (written == next) {
+      client.stop();
+      if (reused) continue; // idle socket was already closed by the gateway
+      lastFailure = FAILURE_TRANSPORT;
+      return false;
+    }
+    latency.record(STAGE_WRITE, micros() - writeStartUs);
+    const RecordWriter::Counters& sent = requestWriter.counters();
+    logLine("TEDAPI sent %u requests: %lu bytes in %lu records, %lu segments", (unsigned)(written - next),
+            (unsigned long)(sent.bytes - sentBefore.bytes), (unsigned long)(sent.records - sentBefore.records),
+            (unsigned long)(sent.segments - sentBefore.segments));
+
+    bool keepAlive = true;
+    bool readFailed = false;
+    size_t done = next;
+    while (done < written && keepAlive) {
+      size_t responseLen = 0;
+      int status = 0;
+      if (!readTedapiResponse(responseBuffer.data(), responseBuffer.size(), &responseLen, &keepAlive, &status)) {
+        readFailed = true;
+        break;
+      }
+      // An error response was read in full, so the connection is still aligned for the next one
+      if (status != 200) {
+        lastFailure = status == 401 || status == 403 ? FAILURE_AUTH : FAILURE_PAYLOAD;
+        allHandled = false;
+      } else if (!requests[done].handle(responseBuffer.data(), responseLen)) {
+        allHandled = false;
+      }
+      done++;
+    }
+
+    if (done == next && reused) {
+      // Kept-alive socket went stale; retry on a fresh connection
+      client.stop();
+      continue;
+    }
+    if (done == next) {
+      // Head request got no usable response; drop it and carry on with the remainder
+      logLine("TEDAPI request %s failed", requests[next].path);
+      client.stop();
+      lastFailure = FAILURE_TRANSPORT;
+      allHandled = false;
+      next++;
+      continue;
+    }
+    if (done < written) {
+      // Resend the rest on a new connection; sequentially only if the gateway closed mid-pipeline
+      client.stop();
+      if (!readFailed && pipelineRequests) {
+        pipelineRequests = false;
+        Serial.println("Gateway does not pipeline; using sequential keep-alive");
+      }
+    } else if (!keepAlive || (done == count && !holdOpen)) {
+      client.stop();
+    }
+    next = done;
+  }
+  return allHandled;
 }
 
-bool Powerwall::sendProtobufRequestTo(const char* path, const uint8_t* data, size_t len, uint8_t* response, size_t responseCapacity, size_t* responseLen) {
-  if (client.connected()) {
+bool Powerwall::connectClient() {
+  // mbedTLS allocates its session and record buffers per connection
+  AllocGuard::Exempt exempt;
+  uint32_t startUs = micros();
+  if (!client.connect(TEDAPI_HOST, TEDAPI_PORT, stageTimeout(TEDAPI_TIMEOUT))) return false;
+  uint32_t connectUs = client.tcpConnectUs();
+  latency.record(STAGE_CONNECT, connectUs);
+  latency.record(STAGE_HANDSHAKE, micros() - startUs - connectUs);
+  requestWriter.attach(client.sslContext(), client.netContext());
+  memory.sample(MEM_CONNECTED);
+  return true;
+}
+
+void Powerwall::benchmarkTls(Print& out, uint8_t rounds) {
+  static const char* const PROFILES[] = { "default", "tuned", "tuned+resume" };
+  for (uint8_t profile = 0; profile < 3; profile++) {
+    uint32_t totalUs = 0, maxUs = 0, sessionHeap = 0;
+    uint8_t ok = 0;
+    for (uint8_t i = 0; i < rounds; i++) {
+      client.stop();
+      if (profile < 2) client.forgetSession();
+      uint32_t freeBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+      uint32_t startUs = micros();
+      bool connected = client.connect(TEDAPI_HOST, TEDAPI_PORT, TEDAPI_TIMEOUT, profile > 0);
+      uint32_t us = micros() - startUs;
+      if (!connected) continue;
+      // Heap held by the live session: record buffers, contexts and the peer certificate
+      uint32_t freeAfter = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+      if (freeBefore > freeAfter && freeBefore - freeAfter > sessionHeap) sessionHeap = freeBefore - freeAfter;
+      if (us > maxUs) maxUs = us;
+      totalUs += us;
+      ok++;
+    }
     client.stop();
-    delay(10);
+    out.printf("[TLS] %-12s %u/%u handshakes, avg %.1f ms, max %.1f ms, session heap %lu\n", PROFILES[profile], ok, rounds,
+               ok ? totalUs / 1000.0 / ok : 0.0, maxUs / 1000.0, (unsigned long)sessionHeap);
   }
-  if (!client.connect(TEDAPI_HOST, TEDAPI_PORT)) {
-    Serial.println("Failed to connect to TEDAPI");
-    return false;
+}
+
+bool Powerwall::writeTedapiRequest(const TedapiRequest& req, bool keepAlive, const Deadline& deadline) {
+  // GET when the request has no body builder (DIN), otherwise POST the protobuf.
+  // The body is built past the header slot and the header rendered to end where it starts.
+  uint8_t* body = requestBuffer.data() + TEDAPI_REQUEST_HEADER_MAX;
+  size_t len = 0;
+  if (req.build) {
+    len = req.build(body, requestBuffer.size() - TEDAPI_REQUEST_HEADER_MAX);
+    if (len == 0) return false;
   }
-  
-  // Build HTTP header. Gateway accepts Basic auth for TEDAPI posts on some firmwares; include it to avoid 403.
-  String auth = "Tesla_Energy_Device:" + String(gw_pwd);
-  String authEncoded = base64::encode(auth);
-  String header = String("POST ") + String(path) + String(" HTTP/1.1\r\n") +
-                  "Host: " + TEDAPI_HOST + "\r\n" +
-                  "Authorization: Basic " + authEncoded + "\r\n" +
-                  "Content-Type: application/octet-stream\r\n" +
-                  "Content-Length: " + String(len) + "\r\n" +
-                  "Connection: close\r\n\r\n";  // MATCH PYTHON: use Connection: close
-  
-  // Send request
-  client.print(header);
-  client.write(data, len);
-  client.flush();
-  
+
+  // MATCH PYTHON: close after the last request
+  size_t headerLen = requestHeader.length(req.path, (bool)req.build, len, keepAlive);
+  if (headerLen == 0 || headerLen > TEDAPI_REQUEST_HEADER_MAX) return false;
+  uint8_t* message = body - headerLen;
+  requestHeader.render((char*)message, req.path, (bool)req.build, len, keepAlive);
+
+  // Header and body go into the same records, and may share the last one with the next request
+  if (!requestWriter.write(message, headerLen + len, deadline)) return false;
+  requestWriter.countRequest();
+  return true;
+}
+
+bool Powerwall::readTedapiResponse(uint8_t* response, size_t responseCapacity, size_t* responseLen, bool* keepAlive, int* status) {
+  *responseLen = 0;
+  *keepAlive = false;
+  *status = 0;
+  unsigned long startMs = millis();
   // Read HTTP response
-  unsigned long timeout = millis() + TEDAPI_TIMEOUT;
-  String httpResponse = "";
+  Deadline deadline = pollBudget.capped(TEDAPI_TIMEOUT);
+  ArenaScope scope(arena);
+  char* httpResponse = (char*)arena.alloc(TEDAPI_RESPONSE_HEADER_MAX);
+  if (!httpResponse) return false;
+  size_t headerLen = 0;
   
-  while (millis() < timeout) {
-    if (client.available()) {
-      char c = client.read();
-      httpResponse += c;
-      
-      if (httpResponse.endsWith("\r\n\r\n")) {
-        break;
-      }
-    } else {
-      delay(10);
-    }
+  uint32_t waitStartUs = micros();
+  if (!waitForData(deadline)) {
+    Serial.println("TEDAPI request failed - no response");
+    client.stop();
+    return false;
   }
+  uint32_t firstByteUs = micros();
+  latency.record(STAGE_FIRST_BYTE, firstByteUs - waitStartUs);
+  bool headerDone = false;
+  while (!headerDone && headerLen + 1 < TEDAPI_RESPONSE_HEADER_MAX && waitForData(deadline)) {
+    // Header names are case-insensitive
+    httpResponse[headerLen++] = (char)tolower(client.read());
+    headerDone = headerLen >= 4 && memcmp(httpResponse + headerLen - 4, "\r\n\r\n", 4) == 0;
+  }
+  httpResponse[headerLen] = 0;
   
   // Headers read complete; sanity check
-  if (httpResponse.length() == 0) {
+  if (!headerDone) {
     Serial.println("TEDAPI request failed - empty header");
     client.stop();
     return false;
   }
   
-  // Check for 200 OK
-  if (httpResponse.indexOf("200 OK") < 0) {
-    Serial.println("TEDAPI request failed - not 200 OK");
-    return false;
+  // The body of an error response is still drained so a kept-alive connection stays aligned
+  const char* statusCode = strchr(httpResponse, ' ');
+  *status = statusCode ? atoi(statusCode + 1) : 0;
+  if (*status != 200) {
+    Serial.printf("TEDAPI request failed - HTTP %d\n", *status);
   }
   
   // Handle chunked encoding or content-length
-  bool isChunked = httpResponse.indexOf("Transfer-Encoding: chunked") >= 0;
+  bool isChunked = strstr(httpResponse, "transfer-encoding: chunked") != nullptr;
+  bool serverClose = strstr(httpResponse, "connection: close") != nullptr;
   int contentLength = 0;
   
   if (!isChunked) {
-    int clStart = httpResponse.indexOf("Content-Length: ");
-    if (clStart >= 0) {
-      clStart += 16;
-      int clEnd = httpResponse.indexOf("\r\n", clStart);
-      if (clEnd >= 0) {
-        contentLength = httpResponse.substring(clStart, clEnd).toInt();
-      }
-    }
+    const char* cl = strstr(httpResponse, "content-length: ");
+    if (cl) contentLength = atoi(cl + 16);
+  }
+  
+  // Compressed bodies are inflated as they arrive, straight into the response buffer
+  Inflater* decoder = nullptr;
+  if (strstr(httpResponse, "content-encoding: gzip")) {
+    if (inflater.begin(Inflater::FORMAT_GZIP, response, responseCapacity)) decoder = &inflater;
+  } else if (strstr(httpResponse, "content-encoding: deflate")) {
+    if (inflater.begin(Inflater::FORMAT_DEFLATE, response, responseCapacity)) decoder = &inflater;
   }
   
   // Read protobuf body
   size_t bytesRead = 0;
-  timeout = millis() + TEDAPI_TIMEOUT;
+  size_t wireBytes = 0;
+  bool bodyError = false;
+  uint8_t window[TEDAPI_INFLATE_WINDOW];
+  // Takes up to `want` body bytes off the socket; false once the body cannot be stored or decoded
+  auto pull = [&](size_t want) -> bool {
+    int n;
+    if (decoder) {
+      n = client.read(window, min(want, sizeof(window)));
+      if (n > 0 && decoder->feed(window, n) == Inflater::INFLATE_ERROR) return false;
+    } else {
+      if (bytesRead >= responseCapacity) return false;
+      n = client.read(response + bytesRead, min(want, responseCapacity - bytesRead));
+      if (n > 0) bytesRead += n;
+    }
+    if (n > 0) wireBytes += n;
+    return true;
+  };
+  bool complete = false;
+  deadline = pollBudget.capped(TEDAPI_TIMEOUT);
+  
+  // Reads one CRLF-terminated line (chunk size or trailer) without the line ending
+  auto readLine = [&](char* line, size_t cap) -> bool {
+    size_t n = 0;
+    while (waitForData(deadline)) {
+      char c = client.read();
+      if (c == '\n') { line[n] = 0; return true; }
+      if (c != '\r' && n + 1 < cap) line[n++] = c;
+    }
+    return false;
+  };
   
   if (isChunked) {
     // Handle chunked encoding
-    while (millis() < timeout && bytesRead < responseCapacity) {
-      if (client.available()) {
-        // Read chunk size line
-        String chunkSizeLine = client.readStringUntil('\n');
-        chunkSizeLine.trim();
-        if (chunkSizeLine.length() == 0) continue;
-        
-        // Parse hex chunk size
-        long chunkSize = strtol(chunkSizeLine.c_str(), nullptr, 16);
-        if (chunkSize == 0) break; // End of chunks
-        
-        // Read chunk data
-        while (chunkSize > 0 && bytesRead < responseCapacity && millis() < timeout) {
-          if (client.available()) {
-            response[bytesRead++] = client.read();
-            chunkSize--;
-          } else {
-            delay(1);
-          }
-        }
-        
-        // Skip trailing CRLF after chunk
-        if (client.available()) client.read(); // \r
-        if (client.available()) client.read(); // \n
-      } else {
-        delay(10);
+    char chunkSizeLine[20];
+    while (!bodyError && readLine(chunkSizeLine, sizeof(chunkSizeLine))) {
+      if (chunkSizeLine[0] == 0) continue;
+      
+      // Parse hex chunk size
+      long chunkSize = strtol(chunkSizeLine, nullptr, 16);
+      if (chunkSize == 0) {
+        // End of chunks; consume the terminating CRLF so a kept-alive connection stays aligned
+        complete = readLine(chunkSizeLine, sizeof(chunkSizeLine));
+        break;
       }
+      
+      // Read chunk data; its trailing CRLF is skipped as an empty line on the next pass
+      size_t chunkEnd = wireBytes + (size_t)chunkSize;
+      while (wireBytes < chunkEnd && waitForData(deadline)) {
+        if (!pull(chunkEnd - wireBytes)) { bodyError = true; break; }
+      }
+      if (wireBytes < chunkEnd) break;
     }
   } else {
     // Handle content-length
-    while (millis() < timeout && bytesRead < contentLength && bytesRead < responseCapacity) {
-      if (client.available()) {
-        response[bytesRead++] = client.read();
-      } else {
-        delay(10);
-      }
+    while (wireBytes < (size_t)contentLength && waitForData(deadline)) {
+      if (!pull((size_t)contentLength - wireBytes)) { bodyError = true; break; }
     }
+    complete = !bodyError && wireBytes == (size_t)contentLength;
   }
   
-  *responseLen = bytesRead;
-  // Body read complete; close connection since we requested Connection: close
-  client.stop();
+  if (decoder) {
+    bytesRead = decoder->outputLength();
+    complete = complete && decoder->finished();
+    logLine("TEDAPI response: %u bytes on air, %u inflated (%lu ms)", (unsigned)wireBytes, (unsigned)bytesRead, millis() - startMs);
+  } else {
+    logLine("TEDAPI response: %u bytes on air (%lu ms)", (unsigned)wireBytes, millis() - startMs);
+  }
   
-  return bytesRead > 0;
+  if (complete) {
+    latency.record(STAGE_BODY_READ, micros() - firstByteUs);
+    memory.sample(MEM_RESPONSE);
+  }
+  *responseLen = bytesRead;
+  *keepAlive = complete && !serverClose;
+  if (bodyError) client.stop();
+  return complete;
 }
 
 bool Powerwall::getStatus() {
-  // Only fetch battery status; config and firmware are not required for battery level
-  return getBatteryData();
+  if (!breaker.allowRequest()) {
+    Serial.printf("TEDAPI circuit open; next probe in %lus\n", breaker.retryInMs() / 1000);
+    return false;
+  }
+  pollBudget = Deadline(TEDAPI_POLL_BUDGET_MS);
+
+  // One pipelined window per poll: config and firmware on the first poll, then status and known battery blocks
+  TedapiRequest batch[3 + MAX_BATTERY_BLOCKS];
+  size_t count = 0;
+  bool statusOk = false;
+  if (!configLoaded) {
+    batch[count++] = configRequest();
+    batch[count++] = firmwareRequest();
+  }
+  batch[count] = statusRequest();
+  batch[count].handle = [this, &statusOk](const uint8_t* data, size_t len) { return statusOk = handleStatusResponse(data, len); };
+  count++;
+  bool blocksQueued = hasBatteryBlocks();
+  if (blocksQueued) {
+    for (uint8_t i = 0; i < haData.block_count; i++) batch[count++] = blockRequest(i);
+  }
+
+  Serial.println("Requesting battery data from TEDAPI...");
+  lastFailure = FAILURE_NONE;
+  bool allOk = sendBatch(batch, count);
+  recordOutcome(statusOk);
+  if (!statusOk && !getBatteryData()) return false;
+
+  // Block list is learned from the status response; fetch it right away on the poll that discovers it
+  if (hasBatteryBlocks() && (!blocksQueued || !allOk)) {
+    if (!fetchBatteryBlocks()) Serial.println("Battery block query incomplete");
+  }
+  return true;
+}
+
+bool Powerwall::hasBatteryBlocks() const {
+#ifdef TEDAPI_COMPONENTS_AUTH_CODE
+  return !blocksFromStatus && (haData.block_count > 1 || (multiplePowerwalls && haData.block_count > 0));
+#else
+  return false;
+#endif
+}
+
+Powerwall::TedapiRequest Powerwall::configRequest() {
+  TedapiRequest req;
+  snprintf(req.path, sizeof(req.path), "/tedapi/v1");
+  req.build = [this](uint8_t* buf, size_t capacity) { return buildConfigRequest(buf, capacity); };
+  req.handle = [this](const uint8_t* data, size_t len) { return configLoaded = handleConfigResponse(data, len); };
+  return req;
+}
+
+Powerwall::TedapiRequest Powerwall::firmwareRequest() {
+  TedapiRequest req;
+  snprintf(req.path, sizeof(req.path), "/tedapi/v1");
+  req.build = [this](uint8_t* buf, size_t capacity) { return buildFirmwareRequest(buf, capacity); };
+  req.handle = [](const uint8_t* data, size_t len) {
+    Serial.println("Firmware response received");
+    return true;
+  };
+  return req;
+}
+
+Powerwall::TedapiRequest Powerwall::statusRequest() {
+  TedapiRequest req;
+  snprintf(req.path, sizeof(req.path), "/tedapi/v1");
+  req.build = [this](uint8_t* buf, size_t capacity) { return buildStatusRequest(buf, capacity); };
+  req.handle = [this](const uint8_t* data, size_t len) { return handleStatusResponse(data, len); };
+  return req;
+}
+
+Powerwall::TedapiRequest Powerwall::blockRequest(uint8_t index) {
+  TedapiRequest req;
+  snprintf(req.path, sizeof(req.path), "/tedapi/device/%s/v1", haData.blocks[index].din);
+  // Captures stay within 8 bytes so std::function holds the handler inline instead of on the heap
+  uint16_t generation = blockGeneration;
+  req.build = [this, index](uint8_t* buf, size_t capacity) { return buildComponentsRequest(buf, capacity, haData.blocks[index].din); };
+  req.handle = [this, index, generation](const uint8_t* data, size_t len) {
+    // A changed block list invalidates responses addressed by the old indices
+    if (generation != blockGeneration) return false;
+    return parseBlockData(index, data, len);
+  };
+  return req;
 }
 
-bool Powerwall::getConfig() {
+size_t Powerwall::buildConfigRequest(uint8_t* req, size_t capacity) {
   Serial.println("Requesting config...");
-  if (din.isEmpty()) return false;
+  if (din.isEmpty()) return 0;
 
-  uint8_t req[256];
   size_t len = 0;
 
   // Build minimal config request like Python: delivery=1, sender.local=1, recipient.din, config.send{num=1,file="config.json"}, tail=1
@@ -303,6 +547,7 @@ bool Powerwall::getConfig() {
                         1 + encodeVarint(nullptr, senderSize) + senderSize +
                         1 + encodeVarint(nullptr, recipientSize) + recipientSize +
                         1 + encodeVarint(nullptr, configSize) + configSize;
+  if (1 + encodeVarint(nullptr, envelopeSize) + envelopeSize + 4 > capacity) return 0;
 
   // message
   req[len++] = 0x0A; // field 1
@@ -330,35 +575,41 @@ bool Powerwall::getConfig() {
     req[len++] = 0x08; // Tail.value field 1, varint
     req[len++] = 0x01; // value = 1
   }
+  return len;
+}
 
-  uint8_t response[4096]; size_t responseLen;
-  if (!sendProtobufRequest(req, len, response, sizeof(response), &responseLen)) return false;
+bool Powerwall::handleConfigResponse(const uint8_t* response, size_t responseLen) {
   // Minimal logging: skip full hex dump
   // Try to find a '{' JSON config and detect number of powerwalls
   for (size_t i = 0; i < responseLen; i++) {
     if (response[i] == '{') {
-      String json; int braces=0; bool start=false;
-      for (size_t j=i; j<responseLen; j++) { char c=(char)response[j]; if (c=='{'){braces++; start=true;} if (start) json+=c; if (c=='}'){braces--; if (braces==0) break; } }
-      Serial.println("Config JSON found:"); Serial.println(json);
-      DynamicJsonDocument doc(8192);
-      if (deserializeJson(doc, json) == DeserializationError::Ok) {
+      StaticJsonDocument<128> filter;
+      filter["battery_blocks"][0]["vin"] = true;
+      filter["battery_blocks"][0]["type"] = true;
+      ArenaScope scope(arena);
+      // Every requested PCH signal passes the filter by name, so size for the full pypowerwall list
+  ArenaJsonDocument doc(4096, ArenaJsonAllocator(&arena));
+      if (deserializeJson(doc, (const char*)&response[i], responseLen - i, DeserializationOption::Filter(filter)) == DeserializationError::Ok) {
         // Detect multiple Powerwalls from config.json top-level "battery_blocks"
         JsonVariant blocks = doc["battery_blocks"];
         if (!blocks.isNull() && blocks.is<JsonArray>()) {
           JsonArray arr = blocks.as<JsonArray>();
           multiplePowerwalls = arr.size() > 1;
-          Serial.printf("Detected multiple Powerwalls: %s\n", multiplePowerwalls ? "yes" : "no");
+          Serial.printf("Config lists %d battery blocks; multiple Powerwalls: %s\n", (int)arr.size(), multiplePowerwalls ? "yes" : "no");
         }
       }
       break;
     }
   }
   // Additionally, try to extract the config.recv.code (TEDAPI auth code) from the protobuf
-  std::vector<uint8_t> code;
-  if (extractConfigCodeFromMessage(response, response + responseLen, code) && !code.empty()) {
-    authCodeOverride = code; useAuthOverride = true;
-    Serial.printf("Extracted TEDAPI code from config response (%d bytes): ", (int)code.size());
-    for (size_t i = 0; i < code.size() && i < 20; i++) {
+  const uint8_t* code = nullptr;
+  size_t codeLen = 0;
+  if (extractConfigCodeFromMessage(response, response + responseLen, code, codeLen) && codeLen > 0 && codeLen <= sizeof(authCodeOverride)) {
+    memcpy(authCodeOverride, code, codeLen);
+    authCodeOverrideLen = codeLen;
+    useAuthOverride = true;
+    Serial.printf("Extracted TEDAPI code from config response (%d bytes): ", (int)codeLen);
+    for (size_t i = 0; i < codeLen && i < 20; i++) {
       Serial.printf("%02X ", code[i]);
     }
     Serial.println();
@@ -391,6 +642,12 @@ void Powerwall::parseStatusData(const uint8_t* data, size_t len) {
   Serial.println("Firmware response received - authentication successful!");
 }
 
+void Powerwall::prewarm() {
+  if (!isConnected() || breaker.state() != CircuitBreaker::CLOSED || client.connected()) return;
+  pollBudget = Deadline(TEDAPI_TIMEOUT);
+  if (connectClient()) Serial.println("TEDAPI session pre-warmed");
+}
+
 bool Powerwall::fetchBatteryLevel() {
   if (!wifiConnected) {
     return false;
@@ -411,6 +668,34 @@ bool Powerwall::isConnected() {
   return wifiConnected && WiFi.status() == WL_CONNECTED && !din.isEmpty();
 }
 
+LinkState Powerwall::linkState() {
+  if (!isConnected()) return LINK_OFFLINE;
+  return breaker.state() == CircuitBreaker::CLOSED ? LINK_ONLINE : LINK_DEGRADED;
+}
+
+unsigned long Powerwall::breakerRetryInMs() const {
+  return breaker.retryInMs();
+}
+
+unsigned long Powerwall::stageTimeout(unsigned long limit) const {
+  return min(limit, pollBudget.remaining());
+}
+
+bool Powerwall::waitForData(const Deadline& deadline) {
+  // The TLS layer may already hold decrypted bytes that select() cannot see
+  while (!client.available()) {
+    if (!client.connected() || !waitReadable(client.socketFd(), deadline)) return false;
+  }
+  return true;
+}
+
+void Powerwall::recordOutcome(bool ok) {
+  // Payload problems mean the gateway is reachable and answering, so they close the breaker like a success;
+  // any other failure, including one that set no reason, counts against it
+  if (ok || lastFailure == FAILURE_PAYLOAD) breaker.recordSuccess();
+  else breaker.recordFailure();
+}
+
 void Powerwall::printBatteryLevel() {
   if (currentData.data_valid) {
     Serial.printf("Powerwall Battery: %.1f%% (TEDAPI)\n", currentData.battery_level);
@@ -463,8 +748,8 @@ static bool skipField(const uint8_t*& p, const uint8_t* end, uint8_t wireType) {
   }
 }
 
-static String extractRecvTextFromQueryType(const uint8_t* p, const uint8_t* end);
-static String extractRecvTextFromMessage(const uint8_t* p, const uint8_t* end) {
+// recv.text is returned as a view into the response buffer
+static bool extractRecvTextFromMessage(const uint8_t* p, const uint8_t* end, const char** text, size_t* textLen) {
   // message fields: 1: message (envelope), 16: payload (QueryType)
   while (p < end) {
     uint32_t key; if (!readVarint(p, end, key)) break;
@@ -474,23 +759,21 @@ static String extractRecvTextFromMessage(const uint8_t* p, const uint8_t* end) {
       const uint8_t* subEnd = p + len;
       if (fn == 1) {
         // envelope submessage; scan inside for payload
-        String s = extractRecvTextFromMessage(p, subEnd);
-        if (s.length()) return s;
+        if (extractRecvTextFromMessage(p, subEnd, text, textLen)) return true;
       } else if (fn == 16) {
         // QueryType
-        String s = extractRecvTextFromQueryType(p, subEnd);
-        if (s.length()) return s;
+        if (extractRecvTextFromQueryType(p, subEnd, text, textLen)) return true;
       }
       p = subEnd;
     } else {
       if (!skipField(p, end, wt)) break;
     }
   }
-  return String();
+  return false;
 }
 
 // Extract Config.recv.code bytes from message
-static bool extractConfigCodeFromConfigType(const uint8_t* p, const uint8_t* end, std::vector<uint8_t>& outCode) {
+static bool extractConfigCodeFromConfigType(const uint8_t* p, const uint8_t* end, const uint8_t*& outCode, size_t& outLen) {
   while (p < end) {
     uint32_t key; if (!readVarint(p, end, key)) break;
     uint8_t wt = key & 0x07; uint32_t fn = key >> 3;
@@ -503,7 +786,7 @@ static bool extractConfigCodeFromConfigType(const uint8_t* p, const uint8_t* end
         uint8_t wt2 = k2 & 0x07; uint32_t fn2 = k2 >> 3;
         if (fn2 == 2 && wt2 == 2) { // code bytes
           uint32_t bl; if (!readVarint(sub, subEnd, bl)) break; if ((uint32_t)(subEnd - sub) < bl) break;
-          outCode.assign(sub, sub + bl);
+          outCode = sub; outLen = bl;
           return true;
         } else {
           if (!skipField(sub, subEnd, wt2)) break;
@@ -517,7 +800,7 @@ static bool extractConfigCodeFromConfigType(const uint8_t* p, const uint8_t* end
   return false;
 }
 
-static bool extractConfigCodeFromEnvelope(const uint8_t* p, const uint8_t* end, std::vector<uint8_t>& outCode) {
+static bool extractConfigCodeFromEnvelope(const uint8_t* p, const uint8_t* end, const uint8_t*& outCode, size_t& outLen) {
   // MessageEnvelope fields include 15: config (ConfigType)
   while (p < end) {
     uint32_t key; if (!readVarint(p, end, key)) break;
@@ -525,7 +808,7 @@ static bool extractConfigCodeFromEnvelope(const uint8_t* p, const uint8_t* end,
     if (fn == 15 && wt == 2) { // config
       uint32_t len; if (!readVarint(p, end, len)) break; if ((uint32_t)(end - p) < len) break;
       const uint8_t* subEnd = p + len;
-      bool ok = extractConfigCodeFromConfigType(p, subEnd, outCode);
+      bool ok = extractConfigCodeFromConfigType(p, subEnd, outCode, outLen);
       if (ok) return true;
       p = subEnd;
     } else if (wt == 2) {
@@ -537,7 +820,7 @@ static bool extractConfigCodeFromEnvelope(const uint8_t* p, const uint8_t* end,
   return false;
 }
 
-static bool extractConfigCodeFromMessage(const uint8_t* p, const uint8_t* end, std::vector<uint8_t>& outCode) {
+static bool extractConfigCodeFromMessage(const uint8_t* p, const uint8_t* end, const uint8_t*& outCode, size_t& outLen) {
   // message field 1: envelope
   while (p < end) {
     uint32_t key; if (!readVarint(p, end, key)) break;
@@ -545,7 +828,7 @@ static bool extractConfigCodeFromMessage(const uint8_t* p, const uint8_t* end, s
     if (fn == 1 && wt == 2) {
       uint32_t len; if (!readVarint(p, end, len)) break; if ((uint32_t)(end - p) < len) break;
       const uint8_t* subEnd = p + len;
-      bool ok = extractConfigCodeFromEnvelope(p, subEnd, outCode);
+      bool ok = extractConfigCodeFromEnvelope(p, subEnd, outCode, outLen);
       if (ok) return true;
       p = subEnd;
     } else {
@@ -555,24 +838,24 @@ static bool extractConfigCodeFromMessage(const uint8_t* p, const uint8_t* end, s
   return false;
 }
 
-static String extractRecvTextFromPayloadString(const uint8_t* p, const uint8_t* end) {
+static bool extractRecvTextFromPayloadString(const uint8_t* p, const uint8_t* end, const char** text, size_t* textLen) {
   // PayloadString: 1:value (varint), 2:text (string)
   while (p < end) {
     uint32_t key; if (!readVarint(p, end, key)) break;
     uint8_t wt = key & 0x07; uint32_t fn = key >> 3;
     if (fn == 2 && wt == 2) {
       uint32_t len; if (!readVarint(p, end, len)) break; if (uint32_t(end - p) < len) break;
-      String s; s.reserve(len);
-      for (uint32_t i = 0; i < len; i++) s += char(p[i]);
-      return s;
+      *text = (const char*)p;
+      *textLen = len;
+      return len > 0;
     } else {
       if (!skipField(p, end, wt)) break;
     }
   }
-  return String();
+  return false;
 }
 
-static String extractRecvTextFromQueryType(const uint8_t* p, const uint8_t* end) {
+static bool extractRecvTextFromQueryType(const uint8_t* p, const uint8_t* end, const char** text, size_t* textLen) {
   // QueryType: 1: send, 2: recv (PayloadString)
   while (p < end) {
     uint32_t key; if (!readVarint(p, end, key)) break;
@@ -580,28 +863,16 @@ static String extractRecvTextFromQueryType(const uint8_t* p, const uint8_t* end)
     if (fn == 2 && wt == 2) {
       uint32_t len; if (!readVarint(p, end, len)) break; if (uint32_t(end - p) < len) break;
       const uint8_t* subEnd = p + len;
-      String s = extractRecvTextFromPayloadString(p, subEnd);
-      return s;
+      return extractRecvTextFromPayloadString(p, subEnd, text, textLen);
     } else {
       if (!skipField(p, end, wt)) break;
     }
   }
-  return String();
+  return false;
 }
 
-bool Powerwall::getBatteryData() {
-  Serial.println("Requesting battery data from TEDAPI...");
-  
-  if (din.isEmpty()) {
-    Serial.println("No DIN available - cannot request battery data");
-    return false;
-  }
-  
-  // Use existing connection to reduce memory churn
-  // Using existing connection
-  
-  // GraphQL query MUST MATCH the Python reference exactly for the precomputed signature to validate
-  const char* graphqlQuery = R"( query DeviceControllerQuery {
+// GraphQL query MUST MATCH the Python reference exactly for the precomputed signature to validate
+static const char STATUS_QUERY[] = R"( query DeviceControllerQuery {
   control {
     systemStatus {
         nominalFullPackEnergyWh
@@ -960,38 +1231,172 @@ bool Powerwall::getBatteryData() {
   }
 }
 )";
-  size_t graphqlLen = strlen(graphqlQuery);
-  
-  // Hardcoded DER auth code used by Python reference for status query
-  static const uint8_t authCodeStatus[] PROGMEM = {
-    0x30,0x81,0x86,0x02,0x41,0x14,0xB1,0x97,0xA5,0x7F,0xAD,0xB5,0xBA,0xD1,0x72,0x1A,
-    0xA8,0xBD,0x6A,0xC5,0x18,0x98,0x30,0xB6,0x12,0x42,0xA2,0xB4,0x70,0x4F,0xB2,0x14,
-    0x76,0x64,0xB7,0xCE,0x1A,0x0C,0xFE,0xD2,0x56,0x01,0x0C,0x7F,0x2A,0xF6,0xE5,0xDB,
-    0x67,0x5F,0x2F,0x60,0x0B,0x16,0x95,0x5F,0x71,0x63,0x13,0x24,0xD3,0x8E,0x79,0xBE,
-    0x7E,0xDD,0x41,0x31,0x12,0x78,0x02,0x41,0x70,0x07,0x5F,0xB4,0x1F,0x5D,0xC4,0x3E,
-    0xF2,0xEE,0x05,0xA5,0x56,0xC1,0x7F,0x2A,0x08,0xC7,0x0E,0xA6,0x5D,0x1F,0x82,0xA2,
-    0xEB,0x49,0x7E,0xDA,0xCF,0x11,0xDE,0x06,0x1B,0x71,0xCF,0xC9,0xB4,0xCD,0xFC,0x1E,
-    0xF5,0x73,0xBA,0x95,0x8D,0x23,0x6F,0x21,0xCD,0x7A,0xEB,0xE5,0x7A,0x96,0xF5,0xE1,
-    0x0C,0xB5,0xAE,0x72,0xFB,0xCB,0x2F,0x17,0x1F
-  };
 
+// Hardcoded DER auth code used by Python reference for status query
+static const uint8_t STATUS_AUTH_CODE[] PROGMEM = {
+  0x30,0x81,0x86,0x02,0x41,0x14,0xB1,0x97,0xA5,0x7F,0xAD,0xB5,0xBA,0xD1,0x72,0x1A,
+  0xA8,0xBD,0x6A,0xC5,0x18,0x98,0x30,0xB6,0x12,0x42,0xA2,0xB4,0x70,0x4F,0xB2,0x14,
+  0x76,0x64,0xB7,0xCE,0x1A,0x0C,0xFE,0xD2,0x56,0x01,0x0C,0x7F,0x2A,0xF6,0xE5,0xDB,
+  0x67,0x5F,0x2F,0x60,0x0B,0x16,0x95,0x5F,0x71,0x63,0x13,0x24,0xD3,0x8E,0x79,0xBE,
+  0x7E,0xDD,0x41,0x31,0x12,0x78,0x02,0x41,0x70,0x07,0x5F,0xB4,0x1F,0x5D,0xC4,0x3E,
+  0xF2,0xEE,0x05,0xA5,0x56,0xC1,0x7F,0x2A,0x08,0xC7,0x0E,0xA6,0x5D,0x1F,0x82,0xA2,
+  0xEB,0x49,0x7E,0xDA,0xCF,0x11,0xDE,0x06,0x1B,0x71,0xCF,0xC9,0xB4,0xCD,0xFC,0x1E,
+  0xF5,0x73,0xBA,0x95,0x8D,0x23,0x6F,0x21,0xCD,0x7A,0xEB,0xE5,0x7A,0x96,0xF5,0xE1,
+  0x0C,0xB5,0xAE,0x72,0xFB,0xCB,0x2F,0x17,0x1F
+};
+
+// Per-device ComponentsQuery from pypowerwall (TEDAPI get_pw3_vitals); the signature covers this text
+static const char COMPONENTS_QUERY[] = R"( query ComponentsQuery (
+  $pchComponentsFilter: ComponentFilter,
+  $pchSignalNames: [String!],
+  $pwsComponentsFilter: ComponentFilter,
+  $pwsSignalNames: [String!],
+  $bmsComponentsFilter: ComponentFilter,
+  $bmsSignalNames: [String!],
+  $hvpComponentsFilter: ComponentFilter,
+  $hvpSignalNames: [String!],
+  $baggrComponentsFilter: ComponentFilter,
+  $baggrSignalNames: [String!],
+  ) {
+  # TODO STST-57686: Introduce GraphQL fragments to shorten
+  pw3Can {
+    firmwareUpdate {
+      isUpdating
+      progress {
+         updating
+         numSteps
+         currentStep
+         currentStepProgress
+         progress
+      }
+    }
+  }
+  components {
+    pws: components(filter: $pwsComponentsFilter) {
+      signals(names: $pwsSignalNames) {
+        name
+        value
+        textValue
+        boolValue
+        timestamp
+      }
+      activeAlerts {
+        name
+      }
+    }
+    pch: components(filter: $pchComponentsFilter) {
+      signals(names: $pchSignalNames) {
+        name
+        value
+        textValue
+        boolValue
+        timestamp
+      }
+      activeAlerts {
+        name
+      }
+    }
+    bms: components(filter: $bmsComponentsFilter) {
+      signals(names: $bmsSignalNames) {
+        name
+        value
+        textValue
+        boolValue
+        timestamp
+      }
+      activeAlerts {
+        name
+      }
+    }
+    hvp: components(filter: $hvpComponentsFilter) {
+      partNumber
+      serialNumber
+      signals(names: $hvpSignalNames) {
+        name
+        value
+        textValue
+        boolValue
+        timestamp
+      }
+      activeAlerts {
+        name
+      }
+    }
+    baggr: components(filter: $baggrComponentsFilter) {
+      signals(names: $baggrSignalNames) {
+        name
+        value
+        textValue
+        boolValue
+        timestamp
+      }
+      activeAlerts {
+        name
+      }
+    }
+  }
+}
+)";
+
+// Query variables as pypowerwall sends them; parseBlockData reads the BMS energies and PCH_BatteryPower
+static const char COMPONENTS_VARIABLES[] =
+  "{\"pwsComponentsFilter\":{\"types\":[\"PW3SAF\"]},"
+  "\"pwsSignalNames\":[\"PWS_SelfTest\",\"PWS_PeImpTestState\",\"PWS_PvIsoTestState\",\"PWS_RelaySelfTest_State\","
+  "\"PWS_MciTestState\",\"PWS_appGitHash\",\"PWS_ProdSwitch_State\"],"
+  "\"pchComponentsFilter\":{\"types\":[\"PCH\"]},"
+  "\"pchSignalNames\":[\"PCH_State\",\"PCH_PvState_A\",\"PCH_PvState_B\",\"PCH_PvState_C\",\"PCH_PvState_D\","
+  "\"PCH_PvState_E\",\"PCH_PvState_F\",\"PCH_AcFrequency\",\"PCH_AcVoltageAB\",\"PCH_AcVoltageAN\",\"PCH_AcVoltageBN\","
+  "\"PCH_packagePartNumber_1_7\",\"PCH_packagePartNumber_8_14\",\"PCH_packagePartNumber_15_20\","
+  "\"PCH_packageSerialNumber_1_7\",\"PCH_packageSerialNumber_8_14\",\"PCH_PvVoltageA\",\"PCH_PvVoltageB\","
+  "\"PCH_PvVoltageC\",\"PCH_PvVoltageD\",\"PCH_PvVoltageE\",\"PCH_PvVoltageF\",\"PCH_PvCurrentA\",\"PCH_PvCurrentB\","
+  "\"PCH_PvCurrentC\",\"PCH_PvCurrentD\",\"PCH_PvCurrentE\",\"PCH_PvCurrentF\",\"PCH_BatteryPower\","
+  "\"PCH_AcRealPowerAB\",\"PCH_SlowPvPowerSum\",\"PCH_AcMode\",\"PCH_AcFrequency\",\"PCH_DcdcState_A\","
+  "\"PCH_DcdcState_B\",\"PCH_appGitHash\"],"
+  "\"bmsComponentsFilter\":{\"types\":[\"PW3BMS\"]},"
+  "\"bmsSignalNames\":[\"BMS_nominalEnergyRemaining\",\"BMS_nominalFullPackEnergy\",\"BMS_appGitHash\"],"
+  "\"hvpComponentsFilter\":{\"types\":[\"PW3HVP\"]},"
+  "\"hvpSignalNames\":[\"HVP_State\",\"HVP_appGitHash\"],"
+  "\"baggrComponentsFilter\":{\"types\":[\"BAGGR\"]},"
+  "\"baggrSignalNames\":[\"BAGGR_State\",\"BAGGR_OperationRequest\",\"BAGGR_NumBatteriesConnected\","
+  "\"BAGGR_NumBatteriesPresent\",\"BAGGR_NumBatteriesExpected\",\"BAGGR_LOG_BattConnectionStatus0\","
+  "\"BAGGR_LOG_BattConnectionStatus1\",\"BAGGR_LOG_BattConnectionStatus2\",\"BAGGR_LOG_BattConnectionStatus3\"]}";
+
+#ifdef TEDAPI_COMPONENTS_AUTH_CODE
+static const uint8_t COMPONENTS_AUTH_CODE[] PROGMEM = { TEDAPI_COMPONENTS_AUTH_CODE };
+#endif
+
+size_t Powerwall::buildStatusRequest(uint8_t* buf, size_t capacity) {
+  // IMPORTANT: the gateway expects the DER-encoded signature as in Python (137 bytes); the 32-byte
+  // config code causes "Invalid signature format"
+  return buildQueryRequest(buf, capacity, din.c_str(), false, STATUS_QUERY, STATUS_AUTH_CODE, sizeof(STATUS_AUTH_CODE), "{}", 1);
+}
+
+size_t Powerwall::buildComponentsRequest(uint8_t* buf, size_t capacity, const char* blockDin) {
+#ifdef TEDAPI_COMPONENTS_AUTH_CODE
+  return buildQueryRequest(buf, capacity, blockDin, true, COMPONENTS_QUERY, COMPONENTS_AUTH_CODE, sizeof(COMPONENTS_AUTH_CODE),
+                           COMPONENTS_VARIABLES, 2);
+#else
+  return 0;
+#endif
+}
+
+void Powerwall::ensureBuffers() {
   // Reuse persistent buffers to avoid heap fragmentation
-  const size_t requestCapacity = 8192;      // ~7KB assembled
+  const size_t requestCapacity = TEDAPI_REQUEST_HEADER_MAX + 8192;  // header slot + ~7KB body
   const size_t responseCapacity = 24576;    // typical < 20KB
   if (requestBuffer.size() < requestCapacity) requestBuffer.resize(requestCapacity);
   if (responseBuffer.size() < responseCapacity) responseBuffer.resize(responseCapacity);
-  uint8_t* requestBuf = requestBuffer.data();
-  uint8_t* responseBuf = responseBuffer.data();
-  memset(requestBuf, 0, requestCapacity);
-  memset(responseBuf, 0, responseCapacity);
-  
+  arena.begin(POLL_ARENA_SIZE);
+  inflater.reserve();
+}
+
+size_t Powerwall::buildQueryRequest(uint8_t* requestBuf, size_t requestCapacity, const char* recipientDin, bool senderIsDin,
+                                    const char* query, const uint8_t* code, size_t codeLen, const char* variables, uint8_t tailValue) {
   size_t len = 0;
-  
-  // Calculate sizes properly using varint encoding
-  size_t dinLen = din.length();
-  // IMPORTANT: For status query, gateway expects DER-encoded signature as in Python (137 bytes)
-  // Do NOT use the 32-byte config code here; it causes "Invalid signature format".
-  size_t codeLen = sizeof(authCodeStatus);
+  size_t graphqlLen = strlen(query);
+  size_t recipientDinLen = strlen(recipientDin);
+  size_t variablesLen = strlen(variables);
+  size_t variablesSize = 1 + encodeVarint(nullptr, variablesLen) + variablesLen;
   
   // PayloadString for payload.send.payload
   size_t payloadStringSize = 1 + 1 + // value field (field + value)
@@ -1001,11 +1406,12 @@ bool Powerwall::getBatteryData() {
   size_t payloadQuerySendSize = 1 + 1 + // num = 2 (field + value)
                                1 + encodeVarint(nullptr, payloadStringSize) + payloadStringSize + // payload
                                1 + encodeVarint(nullptr, codeLen) + codeLen + // DER auth code
-                               1 + 1 + 1 + 1 + 2; // b.value = "{}" (field + len + field + len + content)
+                               1 + encodeVarint(nullptr, variablesSize) + variablesSize; // b.value = query variables
   
   // Participants  
-  size_t recipientSize = 1 + encodeVarint(nullptr, din.length()) + din.length(); // recipient.din - MATCH PYTHON
-  size_t senderSize = 1 + 1; // sender.local = 1 (always for status queries)
+  size_t recipientSize = 1 + encodeVarint(nullptr, recipientDinLen) + recipientDinLen; // recipient.din - MATCH PYTHON
+  // sender.local = 1 for gateway queries; per-device queries name the gateway DIN as sender like Python
+  size_t senderSize = senderIsDin ? 1 + encodeVarint(nullptr, din.length()) + din.length() : 1 + 1;
   
   // QueryType wrapper (payload field 16 contains QueryType which wraps send)
   size_t queryTypeSize = 1 /*send tag*/ + encodeVarint(nullptr, payloadQuerySendSize) + payloadQuerySendSize;
@@ -1016,6 +1422,9 @@ bool Powerwall::getBatteryData() {
                        1 + encodeVarint(nullptr, recipientSize) + recipientSize + // recipient
                        2 /*field 16 tag*/ + encodeVarint(nullptr, queryTypeSize) + queryTypeSize; // payload (QueryType)
   
+  size_t totalSize = 1 + encodeVarint(nullptr, envelopeSize) + envelopeSize + 4 /*tail*/;
+  if (totalSize > requestCapacity) { Serial.println("Request overflow on TEDAPI query"); return 0; }
+  
   // Root message (field 1)
   requestBuf[len++] = 0x0A; // field 1, wire type 2
   len += encodeVarint(&requestBuf[len], envelopeSize);
@@ -1024,19 +1433,26 @@ bool Powerwall::getBatteryData() {
   requestBuf[len++] = 0x08; // field 1, wire type 0
   requestBuf[len++] = 0x01; // value 1
   
-  // sender (field 2) - always use sender.local = 1 for status queries like Python
+  // sender (field 2)
   requestBuf[len++] = 0x12; // field 2, wire type 2
   len += encodeVarint(&requestBuf[len], senderSize);
-  requestBuf[len++] = 0x18; // field 3, wire type 0 (local)
-  requestBuf[len++] = 0x01; // value 1
+  if (senderIsDin) {
+    requestBuf[len++] = 0x0A; // field 1, wire type 2 (din)
+    len += encodeVarint(&requestBuf[len], din.length());
+    memcpy(&requestBuf[len], din.c_str(), din.length());
+    len += din.length();
+  } else {
+    requestBuf[len++] = 0x18; // field 3, wire type 0 (local)
+    requestBuf[len++] = 0x01; // value 1
+  }
   
   // recipient (field 3) - MATCH PYTHON: use recipient.din (NOT local!)
   requestBuf[len++] = 0x1A; // field 3, wire type 2
   len += encodeVarint(&requestBuf[len], recipientSize);
   requestBuf[len++] = 0x0A; // field 1, wire type 2 (din)
-  len += encodeVarint(&requestBuf[len], din.length());
-  memcpy(&requestBuf[len], din.c_str(), din.length());
-  len += din.length();
+  len += encodeVarint(&requestBuf[len], recipientDinLen);
+  memcpy(&requestBuf[len], recipientDin, recipientDinLen);
+  len += recipientDinLen;
   
   // payload (field 16 = QueryType)
   requestBuf[len++] = 0x82; // field 16, wire type 2 (128 + 2 = 130 = 0x82)
@@ -1058,79 +1474,95 @@ bool Powerwall::getBatteryData() {
   requestBuf[len++] = 0x01; // value 1
   requestBuf[len++] = 0x12; // field 2, wire type 2 (text)
   len += encodeVarint(&requestBuf[len], graphqlLen);
-  memcpy(&requestBuf[len], graphqlQuery, graphqlLen);
+  memcpy(&requestBuf[len], query, graphqlLen);
   len += graphqlLen;
   
   // Write auth code (field 3)
-  // Using embedded DER auth code for status query
-    requestBuf[len++] = 0x1A; // field 3, wire type 2
+  requestBuf[len++] = 0x1A; // field 3, wire type 2
   len += encodeVarint(&requestBuf[len], codeLen);
-  if (len + codeLen > requestCapacity) { Serial.println("Request overflow on auth code"); return false; }
-  memcpy_P(&requestBuf[len], authCodeStatus, codeLen);
+  memcpy_P(&requestBuf[len], code, codeLen);
   len += codeLen;
   
-  
   // send.b (field 4)
   requestBuf[len++] = 0x22; // field 4, wire type 2
-  requestBuf[len++] = 0x04; // length 4
+  len += encodeVarint(&requestBuf[len], variablesSize);
   requestBuf[len++] = 0x0A; // field 1, wire type 2 (value)
-  requestBuf[len++] = 0x02; // string length 2
-  requestBuf[len++] = '{'; // content
-  requestBuf[len++] = '}'; // content
+  len += encodeVarint(&requestBuf[len], variablesLen);
+  memcpy(&requestBuf[len], variables, variablesLen);
+  len += variablesLen;
   
-  // tail: field 2 (length-delimited), inner Tail.value = 1 or 2 - MATCH PYTHON
+  // tail: field 2 (length-delimited), inner Tail.value - MATCH PYTHON (1 for status, 2 for per-device)
   requestBuf[len++] = 0x12; // field 2, wire type 2
   requestBuf[len++] = 0x02; // length of Tail message
   requestBuf[len++] = 0x08; // Tail field 1, varint
-  requestBuf[len++] = 0x01; // Python uses tail.value = 1 for status
+  requestBuf[len++] = tailValue;
   
-  
-  
-  // Print hex dump of our protobuf for debugging
-  // Skip protobuf hex dump
-  
-  size_t responseLen = 0;
-  const char* path = "/tedapi/v1";
+  return len;
+}
 
+bool Powerwall::handleStatusResponse(const uint8_t* responseBuf, size_t responseLen) {
+  bool hasJson = false;
+  for (size_t i = 0; i < responseLen; i++) { if (responseBuf[i] == '{') { hasJson = true; break; } }
+  bool authError = false;
+  const char* needle = "missing AuthEnvelo";
+  size_t nlen = strlen(needle);
+  for (size_t i = 0; i + nlen <= responseLen; i++) { size_t k = 0; while (k < nlen && (char)responseBuf[i+k] == needle[k]) k++; if (k == nlen) { authError = true; break; } }
+  if (hasJson && !authError) {
+    if (parseBatteryData(responseBuf, responseLen)) {
+      return true;
+    }
+    Serial.println("Battery query returned JSON but no valid metrics");
+  } else {
+    Serial.println(authError ? "Battery query rejected (missing AuthEnvelope)" : "Battery query failed (invalid payload)");
+  }
+  lastFailure = authError ? FAILURE_AUTH : FAILURE_PAYLOAD;
+  return false;
+}
+
+bool Powerwall::getBatteryData() {
+  if (din.isEmpty()) {
+    Serial.println("No DIN available - cannot request battery data");
+    return false;
+  }
+
+  // Retry path after the pipelined status request failed
   const int maxAttempts = 5;
   unsigned long backoffMs = 100;
   for (int attempt = 1; attempt <= maxAttempts; attempt++) {
-    bool ok = sendProtobufRequestTo(path, requestBuf, len, responseBuf, responseCapacity, &responseLen);
-    if (ok) {
-      bool hasJson = false;
-      for (size_t i = 0; i < responseLen; i++) { if (responseBuf[i] == '{') { hasJson = true; break; } }
-      bool authError = false;
-      const char* needle = "missing AuthEnvelo";
-      size_t nlen = strlen(needle);
-      for (size_t i = 0; i + nlen <= responseLen; i++) { size_t k = 0; while (k < nlen && (char)responseBuf[i+k] == needle[k]) k++; if (k == nlen) { authError = true; break; } }
-      if (hasJson && !authError) {
-        if (parseBatteryData(responseBuf, responseLen)) {
-          return true;
-        } else {
-          Serial.println("Battery query returned JSON but no valid metrics");
-        }
-      } else {
-        Serial.println("Battery query failed (invalid payload)");
-      }
-    } else {
-      Serial.printf("Battery query attempt %d failed (transport)\n", attempt);
-    }
-
     // Decide whether to retry
     if (WiFi.status() != WL_CONNECTED) break; // no wifi
+    if (!breaker.allowRequest()) break; // tripped by the previous attempt
     client.stop();
     int jitterMs = (int)(millis() & 0x3F); // 0-63ms jitter
+    if (pollBudget.remaining() <= backoffMs + jitterMs) break; // no budget left for another round-trip
     delay(backoffMs + jitterMs);
     backoffMs = min<unsigned long>(backoffMs * 2, 1000UL);
+
+    TedapiRequest req = statusRequest();
+    lastFailure = FAILURE_NONE;
+    bool ok = sendBatch(&req, 1);
+    recordOutcome(ok);
+    if (ok) return true;
+    Serial.printf("Battery query attempt %d failed\n", attempt);
   }
   return false;
 }
 
-bool Powerwall::requestFirmware() {
+bool Powerwall::fetchBatteryBlocks() {
+  uint8_t count = haData.block_count;
+  if (count == 0) return false;
+  Serial.printf("Requesting %d battery blocks via TEDAPI...\n", count);
+
+  TedapiRequest batch[MAX_BATTERY_BLOCKS];
+  for (uint8_t i = 0; i < count; i++) batch[i] = blockRequest(i);
+  return sendBatch(batch, count);
+}
+
+size_t Powerwall::buildFirmwareRequest(uint8_t* req, size_t capacity) {
   Serial.println("Requesting firmware via TEDAPI...");
-  if (din.isEmpty()) return false;
+  if (din.isEmpty()) return 0;
 
-  uint8_t req[256]; size_t len=0;
+  size_t len=0;
   // Envelope sizes
   size_t recipientSize = 1 + encodeVarint(nullptr, din.length()) + din.length();
   size_t senderSize = 1 + 1; // local
@@ -1139,6 +1571,7 @@ bool Powerwall::requestFirmware() {
                         1 + encodeVarint(nullptr, senderSize) + senderSize +
                         1 + encodeVarint(nullptr, recipientSize) + recipientSize +
                         1 + encodeVarint(nullptr, firmwareSize) + firmwareSize;
+  if (1 + encodeVarint(nullptr, envelopeSize) + envelopeSize + 2 > capacity) return 0;
   req[len++] = 0x0A; len += encodeVarint(&req[len], envelopeSize);
   req[len++] = 0x08; req[len++] = 0x01; // delivery
   req[len++] = 0x12; len += encodeVarint(&req[len], senderSize); req[len++] = 0x18; req[len++] = 0x01; // sender.local
@@ -1149,125 +1582,283 @@ bool Powerwall::requestFirmware() {
   req[len++] = 0x12; req[len++] = 0x00;
   // tail
   req[len++] = 0x10; req[len++] = 0x01;
+  return len;
+}
+
+// Locate the first complete JSON object inside message.payload.recv.text
+static bool locateRecvJson(const uint8_t* data, size_t len, const char** json, size_t* jsonLen, LatencyStats& latency) {
+  uint32_t extractStartUs = micros();
+  const char* recvText = nullptr;
+  size_t recvLen = 0;
+  if (!extractRecvTextFromMessage(data, data + len, &recvText, &recvLen)) return false;
+  // Extract the first complete JSON object from recv.text
+  const char* startPtr = (const char*)memchr(recvText, '{', recvLen);
+  if (!startPtr) { return false; }
+  size_t start = startPtr - recvText;
+  int braces = 0; bool started = false; int end = -1;
+  for (size_t i = start; i < recvLen; i++) {
+    char c = recvText[i];
+    if (c == '{') { braces++; started = true; }
+    if (started && c == '}') { braces--; if (braces == 0) { end = (int)i; break; } }
+  }
+  if (end < 0) { return false; }
 
-  uint8_t response[4096]; size_t responseLen;
-  if (!sendProtobufRequest(req, len, response, sizeof(response), &responseLen)) return false;
-  Serial.println("Firmware response received");
+  *json = recvText + start;
+  *jsonLen = (size_t)end - start + 1;
+  latency.record(STAGE_PROTOBUF, micros() - extractStartUs);
   return true;
 }
 
-bool Powerwall::parseBatteryData(const uint8_t* data, size_t len) {
+// Locate the controller JSON and parse only the fields we use
+static bool parseControllerJson(const uint8_t* data, size_t len, JsonDocument& doc, JsonVariant& root, LatencyStats& latency) {
+  const char* jsonPtr = nullptr;
+  size_t jsonLen = 0;
+  if (!locateRecvJson(data, len, &jsonPtr, &jsonLen, latency)) return false;
+
+  // Use a filter to only parse the fields we need to reduce memory
+  StaticJsonDocument<1536> filter;
+  // Top-level and nested under data
+  JsonObject fTop = filter.createNestedObject("control");
+  fTop["systemStatus"]["nominalFullPackEnergyWh"] = true;
+  fTop["systemStatus"]["nominalEnergyRemainingWh"] = true;
+  fTop["islanding"]["gridOK"] = true;
+  fTop["islanding"]["customerIslandMode"] = true;
+  fTop["meterAggregates"][0]["location"] = true;
+  fTop["meterAggregates"][0]["realPowerW"] = true;
+  fTop["batteryBlocks"][0]["din"] = true;
+  fTop["alerts"]["active"] = true;
+  filter["esCan"]["bus"]["POD"][0]["POD_EnergyStatus"]["isMIA"] = true;
+  filter["esCan"]["bus"]["POD"][0]["POD_EnergyStatus"]["POD_nom_energy_remaining"] = true;
+  filter["esCan"]["bus"]["POD"][0]["POD_EnergyStatus"]["POD_nom_full_pack_energy"] = true;
+  filter["esCan"]["bus"]["PINV"][0]["PINV_Status"]["PINV_Pout"] = true;
+  JsonObject fAc = filter["esCan"]["bus"]["ISLANDER"].createNestedObject("ISLAND_AcMeasurements");
+  fAc["ISLAND_VL1N_Main"] = true;
+  fAc["ISLAND_VL2N_Main"] = true;
+  fAc["ISLAND_VL3N_Main"] = true;
+  JsonObject fData = filter.createNestedObject("data");
+  JsonObject fCtrl = fData.createNestedObject("control");
+  fCtrl["systemStatus"]["nominalFullPackEnergyWh"] = true;
+  fCtrl["systemStatus"]["nominalEnergyRemainingWh"] = true;
+  fCtrl["islanding"]["gridOK"] = true;
+  fCtrl["islanding"]["customerIslandMode"] = true;
+  fCtrl["meterAggregates"][0]["location"] = true;
+  fCtrl["meterAggregates"][0]["realPowerW"] = true;
+  fCtrl["batteryBlocks"][0]["din"] = true;
+  fCtrl["alerts"]["active"] = true;
+  fData["esCan"] = filter["esCan"];
+  filter["system"]["time"] = true;
+  fData["system"] = filter["system"];
+
+  uint32_t parseStartUs = micros();
+  DeserializationError err = deserializeJson(doc, jsonPtr, jsonLen, DeserializationOption::Filter(filter));
+  if (err) { Serial.print("JSON filter-parse error: "); Serial.println(err.c_str()); return false; }
+  latency.record(STAGE_JSON, micros() - parseStartUs);
 
-  // Try to extract message.payload.recv.text if present
-  String recvText = extractRecvTextFromMessage(data, data + len);
-  if (recvText.length()) {
-    // Extract the first complete JSON object from recv.text (avoid extra String copies)
-    int start = recvText.indexOf('{');
-    if (start < 0) { return false; }
-    int braces = 0; bool started = false; int end = -1;
-    for (int i = start; i < recvText.length(); i++) {
-      char c = recvText.charAt(i);
-      if (c == '{') { braces++; started = true; }
-      if (started && c == '}') { braces--; if (braces == 0) { end = i; break; } }
+  root = doc.as<JsonVariant>();
+  if (doc.containsKey("data")) {
+    root = doc["data"];
+  }
+  return !root["control"].isNull();
+}
+
+// system.time is ISO 8601 with an offset, e.g. 2024-09-18T21:23:17.185286032-07:00
+static int64_t parseGatewayTime(const char* iso) {
+  int year, month, day, hour, minute, second;
+  int consumed = 0;
+  if (sscanf(iso, "%4d-%2d-%2dT%2d:%2d:%2d%n", &year, &month, &day, &hour, &minute, &second, &consumed) != 6) return 0;
+  const char* p = iso + consumed;
+  int millisPart = 0;
+  if (*p == '.') {
+    int scale = 100;
+    for (p++; isdigit((unsigned char)*p); p++) {
+      millisPart += (*p - '0') * scale;
+      scale /= 10;
     }
-    if (end < 0) { return false; }
-
-    const char* jsonPtr = recvText.c_str() + start;
-    size_t jsonLen = (size_t)(end - start + 1);
-
-    // Use a filter to only parse the fields we need to reduce memory
-    StaticJsonDocument<512> filter;
-    // Top-level and nested under data
-    JsonObject fTop = filter.createNestedObject("control");
-    fTop["systemStatus"]["nominalFullPackEnergyWh"] = true;
-    fTop["systemStatus"]["nominalEnergyRemainingWh"] = true;
-    fTop["islanding"]["gridOK"] = true;
-    fTop["islanding"]["customerIslandMode"] = true;
-    fTop["meterAggregates"][0]["location"] = true;
-    fTop["meterAggregates"][0]["realPowerW"] = true;
-    JsonObject fData = filter.createNestedObject("data");
-    JsonObject fCtrl = fData.createNestedObject("control");
-    fCtrl["systemStatus"]["nominalFullPackEnergyWh"] = true;
-    fCtrl["systemStatus"]["nominalEnergyRemainingWh"] = true;
-    fCtrl["islanding"]["gridOK"] = true;
-    fCtrl["islanding"]["customerIslandMode"] = true;
-    fCtrl["meterAggregates"][0]["location"] = true;
-    fCtrl["meterAggregates"][0]["realPowerW"] = true;
-
-    DynamicJsonDocument doc(8192);
-    DeserializationError err = deserializeJson(doc, jsonPtr, jsonLen, DeserializationOption::Filter(filter));
-    if (err) { Serial.print("JSON filter-parse error: "); Serial.println(err.c_str()); return false; }
-
-    JsonVariant root = doc.as<JsonVariant>();
-    if (doc.containsKey("data")) {
-      root = doc["data"];
+  }
+  int offsetMinutes = 0;
+  if (*p == '+' || *p == '-') {
+    int offsetHours = 0, offsetMins = 0;
+    if (sscanf(p + 1, "%2d:%2d", &offsetHours, &offsetMins) != 2) return 0;
+    offsetMinutes = (*p == '-' ? -1 : 1) * (offsetHours * 60 + offsetMins);
+  }
+  // Days since 1970-01-01 for the proleptic Gregorian date
+  int y = year - (month <= 2);
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yearOfEra = y - era * 400;
+  int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  int64_t days = (int64_t)era * 146097 + dayOfEra - 719468;
+  int64_t seconds = days * 86400 + hour * 3600 + minute * 60 + second - offsetMinutes * 60;
+  return seconds * 1000 + millisPart;
+}
+
+// PW2/PW+ blocks report energy and inverter power in the status query's esCan bus, one POD and
+// one PINV per entry of batteryBlocks in the same order; PW3 blocks leave POD empty or MIA
+static bool applyPodBlocks(JsonVariant bus, BatteryBlockData* blocks, uint8_t count) {
+  JsonArray pods = bus["POD"].as<JsonArray>();
+  JsonArray pinvs = bus["PINV"].as<JsonArray>();
+  if (count == 0 || pods.size() < count) return false;
+  for (uint8_t i = 0; i < count; i++) {
+    JsonVariant energy = pods[i]["POD_EnergyStatus"];
+    if ((energy["isMIA"] | false) || energy["POD_nom_full_pack_energy"].isNull()) return false;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    JsonVariant energy = pods[i]["POD_EnergyStatus"];
+    BatteryBlockData& block = blocks[i];
+    block.wh_remaining = energy["POD_nom_energy_remaining"] | 0.0f;
+    block.wh_full = energy["POD_nom_full_pack_energy"] | 0.0f;
+    block.battery_percent = block.wh_full > 0 ? (block.wh_remaining / block.wh_full) * 100.0f : 0.0f;
+    // PINV_Pout is in kW
+    block.power_w = i < pinvs.size() ? (pinvs[i]["PINV_Status"]["PINV_Pout"] | 0.0f) * 1000.0f : 0.0f;
+    block.valid = block.wh_full > 0;
+    logLine("Block %d (%s): batt=%.1f%% rem=%.0fWh full=%.0fWh power=%.0fW",
+            i + 1, block.din, block.battery_percent, block.wh_remaining, block.wh_full, block.power_w);
+  }
+  return true;
+}
+
+static float meterAggregatePower(JsonVariant mags, const char* location) {
+  if (mags.is<JsonArray>()) {
+    for (JsonVariant v : mags.as<JsonArray>()) {
+      const char* loc = v["location"] | "";
+      if (strcmp(loc, location) == 0) return v["realPowerW"] | 0.0f;
     }
-    JsonVariant control = root["control"];
-    if (control.isNull()) { return false; }
-    JsonVariant systemStatus = control["systemStatus"];
-    if (systemStatus.isNull()) { return false; }
-    float remaining = systemStatus["nominalEnergyRemainingWh"] | -1.0f;
-    float total = systemStatus["nominalFullPackEnergyWh"] | -1.0f;
-    if (total >= 0 && remaining >= 0) {
-      currentData.battery_level = (remaining / total) * 100.0f;
-      currentData.energy_remaining = remaining;
-      currentData.total_pack_energy = total;
-      currentData.data_valid = true;
-      currentData.last_update = millis();
-      // Build HomeAutomationData snapshot
-      haData.valid = true;
-      haData.battery_percent = currentData.battery_level;
-      haData.battery_wh_remaining = remaining;
-      haData.battery_wh_full = total;
-      haData.last_update_ms = currentData.last_update;
-      // Grid/island state
-      JsonVariant islanding = control["islanding"];
-      haData.grid_connected = islanding["gridOK"] | false;
-      const char* cmode = islanding["customerIslandMode"] | "";
-      haData.island_mode = String(cmode);
-      // Meter aggregates
-      haData.site_power_w = 0;
-      haData.load_power_w = 0;
-      haData.solar_power_w = 0;
-      haData.battery_power_w = 0;
-      JsonVariant mags = control["meterAggregates"];
-      if (mags.is<JsonArray>()) {
-        for (JsonVariant v : mags.as<JsonArray>()) {
-          const char* loc = v["location"] | "";
-          float p = v["realPowerW"] | 0.0f;
-          if (strcmp(loc, "SITE") == 0) haData.site_power_w = p;
-          else if (strcmp(loc, "LOAD") == 0) haData.load_power_w = p;
-          else if (strcmp(loc, "SOLAR") == 0) haData.solar_power_w = p;
-          else if (strcmp(loc, "BATTERY") == 0) haData.battery_power_w = p;
-        }
-      } else if (mags.is<JsonObject>()) {
-        for (JsonPair kv : mags.as<JsonObject>()) {
-          const char* loc = kv.key().c_str();
-          JsonVariant mv = kv.value();
-          float p = mv["realPowerW"] | 0.0f;
-          if (strcmp(loc, "SITE") == 0) haData.site_power_w = p;
-          else if (strcmp(loc, "LOAD") == 0) haData.load_power_w = p;
-          else if (strcmp(loc, "SOLAR") == 0) haData.solar_power_w = p;
-          else if (strcmp(loc, "BATTERY") == 0) haData.battery_power_w = p;
+  } else if (mags.is<JsonObject>()) {
+    JsonVariant mv = mags[location];
+    if (!mv.isNull()) return mv["realPowerW"] | 0.0f;
+  }
+  return 0.0f;
+}
+
+bool Powerwall::parseBatteryData(const uint8_t* data, size_t len) {
+  ArenaScope scope(arena);
+  ArenaJsonDocument doc(8192, ArenaJsonAllocator(&arena));
+  JsonVariant root;
+  if (!parseControllerJson(data, len, doc, root, latency)) return false;
+  JsonVariant control = root["control"];
+
+  JsonVariant systemStatus = control["systemStatus"];
+  if (systemStatus.isNull()) { return false; }
+  float remaining = systemStatus["nominalEnergyRemainingWh"] | -1.0f;
+  float total = systemStatus["nominalFullPackEnergyWh"] | -1.0f;
+  if (total >= 0 && remaining >= 0) {
+    currentData.battery_level = (remaining / total) * 100.0f;
+    currentData.energy_remaining = remaining;
+    currentData.total_pack_energy = total;
+    currentData.data_valid = true;
+    // Stamped with the request time so connect and response jitter stay out of the sample time
+    currentData.last_update = requestSentMs;
+    // Build HomeAutomationData snapshot
+    haData.valid = true;
+    haData.battery_percent = currentData.battery_level;
+    haData.battery_wh_remaining = remaining;
+    haData.battery_wh_full = total;
+    haData.last_update_ms = currentData.last_update;
+    haData.gateway_time_ms = parseGatewayTime(root["system"]["time"] | "");
+    // Grid/island state
+    JsonVariant islanding = control["islanding"];
+    haData.grid_connected = islanding["gridOK"] | false;
+    const char* cmode = islanding["customerIslandMode"] | "";
+    snprintf(haData.island_mode, sizeof(haData.island_mode), "%s", cmode);
+    // Meter aggregates
+    JsonVariant mags = control["meterAggregates"];
+    haData.site_power_w = meterAggregatePower(mags, "SITE");
+    haData.load_power_w = meterAggregatePower(mags, "LOAD");
+    haData.solar_power_w = meterAggregatePower(mags, "SOLAR");
+    haData.battery_power_w = meterAggregatePower(mags, "BATTERY");
+    // Mains voltage per phase from the islander; phases the site does not have read as 0
+    JsonVariant ac = root["esCan"]["bus"]["ISLANDER"]["ISLAND_AcMeasurements"];
+    haData.grid_voltage_v[0] = ac["ISLAND_VL1N_Main"] | 0.0f;
+    haData.grid_voltage_v[1] = ac["ISLAND_VL2N_Main"] | 0.0f;
+    haData.grid_voltage_v[2] = ac["ISLAND_VL3N_Main"] | 0.0f;
+    JsonVariant alerts = control["alerts"]["active"];
+    haData.alert_count = alerts.is<JsonArray>() ? (uint8_t)min<size_t>(alerts.size(), 255) : 0;
+    // Battery blocks; keep per-block values while the DIN list is unchanged
+    uint8_t count = 0;
+    JsonVariant blocks = control["batteryBlocks"];
+    if (blocks.is<JsonArray>()) {
+      for (JsonVariant b : blocks.as<JsonArray>()) {
+        if (count >= MAX_BATTERY_BLOCKS) break;
+        const char* blockDin = b["din"] | "";
+        if (!blockDin[0]) continue;
+        BatteryBlockData& block = haData.blocks[count++];
+        if (strncmp(block.din, blockDin, sizeof(block.din)) != 0) {
+          blockGeneration++;
+          block = BatteryBlockData();
+          snprintf(block.din, sizeof(block.din), "%s", blockDin);
         }
       }
-      // Now print concise HA summary
-      Serial.printf("HA: batt=%.1f%% rem=%.0fWh full=%.0fWh | site=%.0fW load=%.0fW solar=%.0fW battery=%.0fW | grid=%s mode=%s\n",
-                    haData.battery_percent,
-                    haData.battery_wh_remaining,
-                    haData.battery_wh_full,
-                    haData.site_power_w,
-                    haData.load_power_w,
-                    haData.solar_power_w,
-                    haData.battery_power_w,
-                    haData.grid_connected ? "connected" : "islanded",
-                    haData.island_mode.c_str());
-      return true;
     }
-
-    // If we got here, we had JSON but not the expected fields; skip this cycle quietly.
+    if (count < haData.block_count) blockGeneration++;
+    for (uint8_t i = count; i < haData.block_count; i++) haData.blocks[i] = BatteryBlockData();
+    haData.block_count = count;
+    blocksFromStatus = (count > 1 || multiplePowerwalls) && applyPodBlocks(root["esCan"]["bus"], haData.blocks, count);
+    // Now print concise HA summary
+    logLine("HA: batt=%.1f%% rem=%.0fWh full=%.0fWh | site=%.0fW load=%.0fW solar=%.0fW battery=%.0fW | grid=%s mode=%s %.0f/%.0f/%.0fV | alerts=%d blocks=%d",
+                  haData.battery_percent,
+                  haData.battery_wh_remaining,
+                  haData.battery_wh_full,
+                  haData.site_power_w,
+                  haData.load_power_w,
+                  haData.solar_power_w,
+                  haData.battery_power_w,
+                  haData.grid_connected ? "connected" : "islanded",
+                  haData.island_mode,
+                  haData.grid_voltage_v[0], haData.grid_voltage_v[1], haData.grid_voltage_v[2],
+                  haData.alert_count,
+                  haData.block_count);
+    memory.sample(MEM_PARSED);
+    return true;
   }
-  
-  // Fallback scanning removed – recv.text path is sufficient
+
+  // If we got here, we had JSON but not the expected fields; skip this cycle quietly.
   return false;
-} 
\ No newline at end of file
+}
+
+bool Powerwall::parseBlockData(uint8_t index, const uint8_t* data, size_t len) {
+  if (index >= haData.block_count) return false;
+  BatteryBlockData& block = haData.blocks[index];
+  block.valid = false;
+  const char* json = nullptr;
+  size_t jsonLen = 0;
+  if (!locateRecvJson(data, len, &json, &jsonLen, latency)) return false;
+
+  StaticJsonDocument<256> filter;
+  filter["components"]["bms"][0]["signals"][0]["name"] = true;
+  filter["components"]["bms"][0]["signals"][0]["value"] = true;
+  filter["components"]["pch"][0]["signals"][0]["name"] = true;
+  filter["components"]["pch"][0]["signals"][0]["value"] = true;
+  ArenaScope scope(arena);
+  // Every requested PCH signal passes the filter by name, so size for the full pypowerwall list
+  ArenaJsonDocument doc(4096, ArenaJsonAllocator(&arena));
+  uint32_t parseStartUs = micros();
+  DeserializationError err = deserializeJson(doc, json, jsonLen, DeserializationOption::Filter(filter));
+  if (err) { Serial.print("Components JSON parse error: "); Serial.println(err.c_str()); return false; }
+  latency.record(STAGE_JSON, micros() - parseStartUs);
+
+  // BMS energies are in kWh; a block may report more than one BMS component
+  float remaining = 0, total = 0, power = 0;
+  bool haveRemaining = false, haveTotal = false;
+  for (JsonVariant component : doc["components"]["bms"].as<JsonArray>()) {
+    for (JsonVariant signal : component["signals"].as<JsonArray>()) {
+      const char* name = signal["name"] | "";
+      if (signal["value"].isNull()) continue;
+      if (strcmp(name, "BMS_nominalEnergyRemaining") == 0) { remaining += signal["value"].as<float>() * 1000.0f; haveRemaining = true; }
+      else if (strcmp(name, "BMS_nominalFullPackEnergy") == 0) { total += signal["value"].as<float>() * 1000.0f; haveTotal = true; }
+    }
+  }
+  for (JsonVariant component : doc["components"]["pch"].as<JsonArray>()) {
+    for (JsonVariant signal : component["signals"].as<JsonArray>()) {
+      if (strcmp(signal["name"] | "", "PCH_BatteryPower") == 0) power += signal["value"] | 0.0f;
+    }
+  }
+  if (!haveRemaining || !haveTotal || total <= 0) return false;
+  block.wh_remaining = remaining;
+  block.wh_full = total;
+  block.battery_percent = (remaining / total) * 100.0f;
+  block.power_w = power;
+  block.valid = true;
+  logLine("Block %d (%s): batt=%.1f%% rem=%.0fWh full=%.0fWh power=%.0fW",
+                index + 1, block.din, block.battery_percent, block.wh_remaining, block.wh_full, block.power_w);
+  return true;
+}
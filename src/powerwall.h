@@ -2,23 +2,79 @@
 #define POWERWALL_H
 
 #include <WiFi.h>
-#include <WiFiClientSecure.h>
 #include <HTTPClient.h>
 #include <ArduinoJson.h>
-#include <base64.h>
 #include <vector>
+#include <functional>
+#include "inflater.h"
+#include "circuit_breaker.h"
+#include "deadline.h"
+#include "latency_stats.h"
+#include "memory_stats.h"
+#include "poll_arena.h"
+#include "request_header.h"
+#include "record_writer.h"
+#include "tedapi_client.h"
 
-// TEDAPI Protocol Constants
+// TEDAPI Protocol Constants (host/port can be overridden to point at a local gateway stand-in)
+#ifndef TEDAPI_HOST
 #define TEDAPI_HOST "192.168.91.1"
+#endif
+#ifndef TEDAPI_PORT
 #define TEDAPI_PORT 443
+#endif
 #define TEDAPI_TIMEOUT 10000
+// Wall-clock budget for one poll; connect, header, body and retries all draw from it
+#ifndef TEDAPI_POLL_BUDGET_MS
+#define TEDAPI_POLL_BUDGET_MS 15000
+#endif
+// Budget for joining the gateway Wi-Fi and getting a DHCP lease
+#ifndef WIFI_CONNECT_TIMEOUT_MS
+#define WIFI_CONNECT_TIMEOUT_MS 10000
+#endif
+// Consecutive transport/auth failures before polls fail fast, and the cooldown before a probe
+#define TEDAPI_BREAKER_THRESHOLD 3
+#define TEDAPI_BREAKER_COOLDOWN_MS 30000
+#define TEDAPI_BREAKER_MAX_COOLDOWN_MS 300000
+// Set to "" to disable compressed responses
+#ifndef TEDAPI_ACCEPT_ENCODING
+#define TEDAPI_ACCEPT_ENCODING "gzip, deflate"
+#endif
+// Lead time before a scheduled poll to open the TLS session; 0 connects on the poll itself
+#ifndef TEDAPI_PREWARM_MS
+#define TEDAPI_PREWARM_MS 2000
+#endif
+// Socket read window used while inflating a compressed body
+#define TEDAPI_INFLATE_WINDOW 512
+// Request header space reserved ahead of the body in the request buffer
+#define TEDAPI_REQUEST_HEADER_MAX 512
+// Response header space, taken from the poll arena
+#define TEDAPI_RESPONSE_HEADER_MAX 1024
+#define MAX_BATTERY_BLOCKS 4
 
 struct PowerwallData {
   float battery_level = 0.0f;
   float energy_remaining = 0.0f;
   float total_pack_energy = 0.0f;
   bool data_valid = false;
-  unsigned long last_update = 0;
+  unsigned long last_update = 0;          // millis() when the status request went out
+};
+
+// Per-unit values for sites with more than one battery block
+struct BatteryBlockData {
+  bool valid = false;
+  char din[48] = {0};
+  float battery_percent = 0.0f;           // 0-100
+  float wh_remaining = 0.0f;              // Wh
+  float wh_full = 0.0f;                   // Wh
+  float power_w = 0.0f;                   // discharge(+)/charge(-)
+};
+
+// Gateway link as shown by the display and BLE sinks
+enum LinkState : uint8_t {
+  LINK_OFFLINE,   // no WiFi or DIN
+  LINK_DEGRADED,  // circuit breaker open or probing; values are stale
+  LINK_ONLINE
 };
 
 // Compact snapshot tailored for home automation integrations
@@ -32,42 +88,91 @@ struct HomeAutomationData {
   float solar_power_w = 0.0f;             // solar production
   float battery_power_w = 0.0f;           // battery discharge(+)/charge(-) as provided
   bool grid_connected = false;            // from control.islanding
-  String island_mode;                     // BACKUP/SELF_CONSUMPTION/etc when available
-  unsigned long last_update_ms = 0;       // millis()
+  char island_mode[24] = {0};             // BACKUP/SELF_CONSUMPTION/etc when available
+  float grid_voltage_v[3] = {0, 0, 0};    // line-to-neutral per phase, 0 when absent
+  uint8_t alert_count = 0;                // control.alerts.active
+  unsigned long last_update_ms = 0;       // millis() when the status request went out
+  int64_t gateway_time_ms = 0;            // Unix ms from the gateway clock (system.time), 0 when absent
+  uint8_t block_count = 0;                // entries of control.batteryBlocks
+  BatteryBlockData blocks[MAX_BATTERY_BLOCKS];
 };
 
 class Powerwall {
 private:
+  // One TEDAPI exchange in a batch; the body is built into the shared request buffer just before it is written
+  struct TedapiRequest {
+    char path[72] = {0};
+    std::function<size_t(uint8_t* buf, size_t capacity)> build;   // empty for GET
+    std::function<bool(const uint8_t* data, size_t len)> handle;
+  };
+  enum PollFailure : uint8_t { FAILURE_NONE, FAILURE_TRANSPORT, FAILURE_AUTH, FAILURE_PAYLOAD };
+
   const char* ssid;
   const char* gw_pwd;
   bool wifiConnected = false;
   PowerwallData currentData;
   HomeAutomationData haData;
-  WiFiClientSecure client;
+  TedapiClient client;
   String din;
   bool multiplePowerwalls = false;
+  bool configLoaded = false;
+  bool pipelineRequests = true;
+  uint16_t blockGeneration = 0;
+  // Per-block values came with the status response (esCan POD/PINV), so no ComponentsQuery is needed
+  bool blocksFromStatus = false;
   // Optional runtime/provisioned TEDAPI code override to avoid hardcoding
-  std::vector<uint8_t> authCodeOverride;
+  uint8_t authCodeOverride[64];
+  size_t authCodeOverrideLen = 0;
   bool useAuthOverride = false;
   // Connection maintenance/backoff
   unsigned long lastWifiAttemptMs = 0;
   unsigned long wifiBackoffMs = 0;
   unsigned long lastDINFetchMs = 0;
+  Deadline pollBudget;
+  unsigned long requestSentMs = 0;
+  PollFailure lastFailure = FAILURE_NONE;
+  CircuitBreaker breaker{TEDAPI_BREAKER_THRESHOLD, TEDAPI_BREAKER_COOLDOWN_MS, TEDAPI_BREAKER_MAX_COOLDOWN_MS};
+  RequestHeader requestHeader;
+  RecordWriter requestWriter;
   // Reusable buffers to avoid heap churn
   std::vector<uint8_t> requestBuffer;
   std::vector<uint8_t> responseBuffer;
+  Inflater inflater;
+  PollArena arena;
+  LatencyStats latency;
+  MemoryStats memory;
   
-  bool connectToWiFi();
+  bool connectToWiFi(const Deadline& deadline);
   bool connectTEDAPI();
+  bool connectClient();
   bool getDIN();
-  bool sendProtobufRequest(const uint8_t* data, size_t len, uint8_t* response, size_t responseCapacity, size_t* responseLen);
-  bool sendProtobufRequestTo(const char* path, const uint8_t* data, size_t len, uint8_t* response, size_t responseCapacity, size_t* responseLen);
+  bool sendBatch(TedapiRequest* requests, size_t count, bool holdOpen = false);
+  bool writeTedapiRequest(const TedapiRequest& req, bool keepAlive, const Deadline& deadline);
+  // True when a whole response was read; `status` is its HTTP status code
+  bool readTedapiResponse(uint8_t* response, size_t responseCapacity, size_t* responseLen, bool* keepAlive, int* status);
+  void ensureBuffers();
+  bool waitForData(const Deadline& deadline);
+  unsigned long stageTimeout(unsigned long limit) const;
+  void recordOutcome(bool ok);
+  TedapiRequest configRequest();
+  TedapiRequest firmwareRequest();
+  TedapiRequest statusRequest();
+  TedapiRequest blockRequest(uint8_t index);
+  size_t buildConfigRequest(uint8_t* buf, size_t capacity);
+  size_t buildFirmwareRequest(uint8_t* buf, size_t capacity);
+  size_t buildStatusRequest(uint8_t* buf, size_t capacity);
+  size_t buildComponentsRequest(uint8_t* buf, size_t capacity, const char* blockDin);
+  size_t buildQueryRequest(uint8_t* buf, size_t capacity, const char* recipientDin, bool senderIsDin, const char* query,
+                           const uint8_t* code, size_t codeLen, const char* variables, uint8_t tailValue);
       bool getStatus();
     bool getBatteryData();
-    bool getConfig();
-    bool requestFirmware();
+    bool fetchBatteryBlocks();
+    bool hasBatteryBlocks() const;
+    bool handleConfigResponse(const uint8_t* data, size_t len);
+    bool handleStatusResponse(const uint8_t* data, size_t len);
     void parseStatusData(const uint8_t* data, size_t len);
     bool parseBatteryData(const uint8_t* data, size_t len);
+    bool parseBlockData(uint8_t index, const uint8_t* data, size_t len);
     bool loadAuthCodeOverrideFromConfig();
 
 public:
@@ -77,8 +182,18 @@ public:
   PowerwallData getData();
   HomeAutomationData getHomeData();
   bool isConnected();
+  LinkState linkState();
+  unsigned long breakerRetryInMs() const;
   void printBatteryLevel();
   bool fetchBatteryLevel();
+  // Opens the TLS session ahead of a poll; a no-op when one is already open or the breaker is not closed
+  void prewarm();
+  LatencyStats& latencyStats() { return latency; }
+  MemoryStats& memoryStats() { return memory; }
+  RecordWriter& recordWriter() { return requestWriter; }
+  // Times `rounds` handshakes each with the stock and tuned TLS setup and reports their heap use
+  void benchmarkTls(Print& out, uint8_t rounds);
+  PollArena& pollArena() { return arena; }
 };
 
 #endif // POWERWALL_H 
\ No newline at end of file
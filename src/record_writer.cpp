@@ -0,0 +1,82 @@
+#include "record_writer.h"
+#include <lwip/sockets.h>
+
+int RecordWriter::sendCallback(void* ctx, const unsigned char* buf, size_t len) {
+  RecordWriter* writer = (RecordWriter*)ctx;
+  int ret = mbedtls_net_send(writer->net, buf, len);
+  if (ret > 0) {
+    writer->totals.bytes += ret;
+    writer->totals.segments += (ret + TCP_MSS - 1) / TCP_MSS;
+  }
+  return ret;
+}
+
+int RecordWriter::recvCallback(void* ctx, unsigned char* buf, size_t len) {
+  return mbedtls_net_recv(((RecordWriter*)ctx)->net, buf, len);
+}
+
+void RecordWriter::attach(mbedtls_ssl_context* sslArg, mbedtls_net_context* netArg) {
+  ssl = sslArg;
+  net = netArg;
+  pending = 0;
+  int payload = mbedtls_ssl_get_max_out_record_payload(ssl);
+  recordPayload = payload > 0 ? payload : 0;
+  if (staging.size() < recordPayload) staging.resize(recordPayload);
+  mbedtls_ssl_set_bio(ssl, this, sendCallback, recvCallback, nullptr);
+  // Records are already full when they reach the socket; Nagle would only hold back the tail segment
+  int noDelay = 1;
+  lwip_setsockopt(net->fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+}
+
+bool RecordWriter::write(const uint8_t* data, size_t len, const Deadline& deadline) {
+  if (recordPayload == 0) return false;
+  if (pending) {
+    size_t take = min(len, recordPayload - pending);
+    memcpy(staging.data() + pending, data, take);
+    pending += take;
+    data += take;
+    len -= take;
+    if (pending < recordPayload) return true;
+    pending = 0;
+    if (!emit(staging.data(), recordPayload, deadline)) return false;
+  }
+  for (; len >= recordPayload; data += recordPayload, len -= recordPayload) {
+    if (!emit(data, recordPayload, deadline)) return false;
+  }
+  memcpy(staging.data(), data, len);
+  pending = len;
+  return true;
+}
+
+bool RecordWriter::flush(const Deadline& deadline) {
+  if (pending == 0) return true;
+  size_t len = pending;
+  pending = 0;
+  return emit(staging.data(), len, deadline);
+}
+
+bool RecordWriter::emit(const uint8_t* data, size_t len, const Deadline& deadline) {
+  while (len) {
+    int ret = mbedtls_ssl_write(ssl, data, len);
+    if (ret > 0) {
+      totals.records++;
+      data += ret;
+      len -= ret;
+    } else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      if (!waitWritable(net->fd, deadline)) return false;
+    } else if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+      if (!waitReadable(net->fd, deadline)) return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+void RecordWriter::printTo(Print& out) const {
+  if (totals.requests == 0) return;
+  float n = totals.requests;
+  out.printf("[TLS] %lu requests: %.2f records, %.2f segments, %.0f bytes each; record payload %u\n",
+             (unsigned long)totals.requests, totals.records / n, totals.segments / n, totals.bytes / n,
+             (unsigned)recordPayload);
+}
@@ -0,0 +1,45 @@
+#ifndef RECORD_WRITER_H
+#define RECORD_WRITER_H
+
+#include <Arduino.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <vector>
+#include "deadline.h"
+
+// Packs outgoing application data into full-size TLS records. Whole records go straight from the
+// caller's buffer; the remainder is held until more data fills it or flush() sends it, so a
+// pipelined batch leaves as a run of maximum-size records instead of one short record per write.
+class RecordWriter {
+public:
+  struct Counters {
+    uint32_t requests;
+    uint32_t records;
+    uint32_t segments;  // estimated from the MSS per socket send
+    uint32_t bytes;     // on the wire, including record overhead
+  };
+
+  // Call after each handshake; routes the session's I/O through this writer so sends are counted
+  // here, and drops anything still held for the previous session
+  void attach(mbedtls_ssl_context* ssl, mbedtls_net_context* net);
+  bool write(const uint8_t* data, size_t len, const Deadline& deadline);
+  bool flush(const Deadline& deadline);
+  void countRequest() { totals.requests++; }
+  const Counters& counters() const { return totals; }
+  void printTo(Print& out) const;
+
+private:
+  bool emit(const uint8_t* data, size_t len, const Deadline& deadline);
+  // mbedTLS bio callbacks; the context is the writer
+  static int sendCallback(void* ctx, const unsigned char* buf, size_t len);
+  static int recvCallback(void* ctx, unsigned char* buf, size_t len);
+
+  mbedtls_ssl_context* ssl = nullptr;
+  mbedtls_net_context* net = nullptr;
+  std::vector<uint8_t> staging;
+  size_t recordPayload = 0;
+  size_t pending = 0;
+  Counters totals = {};
+};
+
+#endif // RECORD_WRITER_H
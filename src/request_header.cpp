@@ -0,0 +1,63 @@
+#include "request_header.h"
+#include <mbedtls/base64.h>
+
+static const char BODY_HEADERS[] = "Content-Type: application/octet-stream\r\nContent-Length: ";
+static const char KEEP_ALIVE[] = "Connection: keep-alive\r\n\r\n";
+static const char CLOSE[] = "Connection: close\r\n\r\n";
+
+static size_t digitCount(size_t value) {
+  size_t n = 1;
+  while (value >= 10) { value /= 10; n++; }
+  return n;
+}
+
+bool RequestHeader::begin(const char* host, const char* user, const char* password, const char* acceptEncoding) {
+  fixedLen = 0;
+  char credentials[96];
+  int credentialsLen = snprintf(credentials, sizeof(credentials), "%s:%s", user, password);
+  if (credentialsLen < 0 || credentialsLen >= (int)sizeof(credentials)) return false;
+  unsigned char token[4 * ((sizeof(credentials) + 2) / 3) + 1];
+  size_t tokenLen = 0;
+  if (mbedtls_base64_encode(token, sizeof(token), &tokenLen, (const unsigned char*)credentials, credentialsLen) != 0) return false;
+  token[tokenLen] = 0;
+  // Starts at the space after the path and stops before the Content-Length/Connection lines
+  int len = snprintf(fixed, sizeof(fixed), " HTTP/1.1\r\nHost: %s\r\nAuthorization: Basic %s\r\n", host, (const char*)token);
+  if (len > 0 && acceptEncoding[0] && len < (int)sizeof(fixed)) {
+    len += snprintf(fixed + len, sizeof(fixed) - len, "Accept-Encoding: %s\r\n", acceptEncoding);
+  }
+  if (len <= 0 || len >= (int)sizeof(fixed)) return false;
+  fixedLen = len;
+  return true;
+}
+
+size_t RequestHeader::length(const char* path, bool hasBody, size_t contentLength, bool keepAlive) const {
+  if (fixedLen == 0) return 0;
+  size_t len = (hasBody ? 5 : 4) + strlen(path) + fixedLen;
+  if (hasBody) len += sizeof(BODY_HEADERS) - 1 + digitCount(contentLength) + 2;
+  return len + (keepAlive ? sizeof(KEEP_ALIVE) : sizeof(CLOSE)) - 1;
+}
+
+void RequestHeader::render(char* out, const char* path, bool hasBody, size_t contentLength, bool keepAlive) const {
+  char* p = out;
+  memcpy(p, hasBody ? "POST " : "GET ", hasBody ? 5 : 4);
+  p += hasBody ? 5 : 4;
+  size_t pathLen = strlen(path);
+  memcpy(p, path, pathLen);
+  p += pathLen;
+  memcpy(p, fixed, fixedLen);
+  p += fixedLen;
+  if (hasBody) {
+    memcpy(p, BODY_HEADERS, sizeof(BODY_HEADERS) - 1);
+    p += sizeof(BODY_HEADERS) - 1;
+    size_t digits = digitCount(contentLength);
+    for (size_t i = digits; i > 0; i--) {
+      p[i - 1] = '0' + contentLength % 10;
+      contentLength /= 10;
+    }
+    p += digits;
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  if (keepAlive) memcpy(p, KEEP_ALIVE, sizeof(KEEP_ALIVE) - 1);
+  else memcpy(p, CLOSE, sizeof(CLOSE) - 1);
+}
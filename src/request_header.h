@@ -0,0 +1,21 @@
+#ifndef REQUEST_HEADER_H
+#define REQUEST_HEADER_H
+
+#include <Arduino.h>
+
+// TEDAPI request header with everything but the method, path, Content-Length and Connection
+// rendered once, including the Basic auth token
+class RequestHeader {
+public:
+  bool begin(const char* host, const char* user, const char* password, const char* acceptEncoding);
+  // Bytes render() will write; 0 when the header is not initialised
+  size_t length(const char* path, bool hasBody, size_t contentLength, bool keepAlive) const;
+  // Writes exactly length() bytes, unterminated
+  void render(char* out, const char* path, bool hasBody, size_t contentLength, bool keepAlive) const;
+
+private:
+  char fixed[384];
+  size_t fixedLen = 0;
+};
+
+#endif // REQUEST_HEADER_H
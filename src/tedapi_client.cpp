@@ -0,0 +1,173 @@
+#include "tedapi_client.h"
+#include <WiFi.h>
+#include <errno.h>
+#include <lwip/sockets.h>
+#include <mbedtls/md.h>
+
+// AES-128-GCM with SHA-256 runs on the ESP32 AES and SHA engines; P-256 is the cheapest ECDHE curve
+static const int TUNED_CIPHERSUITES[] = {
+  MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+  MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+  MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+  0
+};
+static const mbedtls_ecp_group_id TUNED_CURVES[] = { MBEDTLS_ECP_DP_SECP256R1, MBEDTLS_ECP_DP_NONE };
+
+TedapiClient::TedapiClient() {
+  mbedtls_net_init(&net);
+  mbedtls_ssl_init(&ssl);
+  mbedtls_ssl_config_init(&conf);
+  mbedtls_ctr_drbg_init(&drbg);
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ssl_session_init(&savedSession);
+}
+
+TedapiClient::~TedapiClient() {
+  stop();
+  mbedtls_ssl_session_free(&savedSession);
+}
+
+void TedapiClient::forgetSession() {
+  mbedtls_ssl_session_free(&savedSession);
+  mbedtls_ssl_session_init(&savedSession);
+  haveSession = false;
+}
+
+void TedapiClient::stop() {
+  if (net.fd >= 0) {
+    lwip_close(net.fd);
+    net.fd = -1;
+  }
+  // The contexts are left initialised so the next connect() and the destructor can free them again
+  mbedtls_ssl_free(&ssl);
+  mbedtls_ssl_config_free(&conf);
+  mbedtls_ctr_drbg_free(&drbg);
+  mbedtls_entropy_free(&entropy);
+  mbedtls_ssl_init(&ssl);
+  mbedtls_ssl_config_init(&conf);
+  mbedtls_ctr_drbg_init(&drbg);
+  mbedtls_entropy_init(&entropy);
+  open = false;
+}
+
+bool TedapiClient::openSocket(const char* host, uint16_t port, const Deadline& deadline) {
+  IPAddress ip;
+  if (!ip.fromString(host) && !WiFi.hostByName(host, ip)) return false;
+  int fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) return false;
+  net.fd = fd;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = (uint32_t)ip;
+  addr.sin_port = htons(port);
+  if (lwip_connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) return true;
+  if (errno != EINPROGRESS || !waitWritable(fd, deadline)) return false;
+  int error = 0;
+  socklen_t errorLen = sizeof(error);
+  return lwip_getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLen) == 0 && error == 0;
+}
+
+bool TedapiClient::connect(const char* host, uint16_t port, unsigned long timeoutMs, bool tuned) {
+  stop();
+  Deadline deadline(timeoutMs);
+  uint32_t startUs = micros();
+  if (!openSocket(host, port, deadline)) {
+    stop();
+    return false;
+  }
+  lastTcpConnectUs = micros() - startUs;
+
+  static const char PERS[] = "tedapi";
+  // The gateway certificate is self-signed; TEDAPI_CERT_SHA256 pins it instead of a CA
+  bool ok = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const unsigned char*)PERS, sizeof(PERS) - 1) == 0 &&
+            mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                        MBEDTLS_SSL_PRESET_DEFAULT) == 0;
+  if (ok) {
+    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+    if (tuned) {
+      mbedtls_ssl_conf_ciphersuites(&conf, TUNED_CIPHERSUITES);
+      mbedtls_ssl_conf_curves(&conf, TUNED_CURVES);
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+      // Gateways that honour it keep their records within 4 KB
+      mbedtls_ssl_conf_max_frag_len(&conf, MBEDTLS_SSL_MAX_FRAG_LEN_4096);
+#endif
+    }
+    ok = mbedtls_ssl_setup(&ssl, &conf) == 0 && mbedtls_ssl_set_hostname(&ssl, host) == 0;
+  }
+  if (ok && tuned && haveSession) mbedtls_ssl_set_session(&ssl, &savedSession);
+  if (ok) mbedtls_ssl_set_bio(&ssl, &net, mbedtls_net_send, mbedtls_net_recv, nullptr);
+
+  // Waits on the socket between handshake steps instead of polling
+  while (ok) {
+    int ret = mbedtls_ssl_handshake(&ssl);
+    if (ret == 0) break;
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ) ok = waitReadable(net.fd, deadline);
+    else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) ok = waitWritable(net.fd, deadline);
+    else ok = false;
+  }
+  if (ok && !pinMatches()) {
+    Serial.println("TEDAPI certificate does not match TEDAPI_CERT_SHA256");
+    forgetSession();
+    ok = false;
+  }
+  if (!ok) {
+    stop();
+    return false;
+  }
+
+  if (tuned) {
+    mbedtls_ssl_session_free(&savedSession);
+    mbedtls_ssl_session_init(&savedSession);
+    haveSession = mbedtls_ssl_get_session(&ssl, &savedSession) == 0;
+  }
+  open = true;
+  return true;
+}
+
+int TedapiClient::available() {
+  if (!open) return 0;
+  int pending = mbedtls_ssl_get_bytes_avail(&ssl);
+  if (pending > 0) return pending;
+  // A zero-length read pulls the next record off the socket without blocking
+  int ret = mbedtls_ssl_read(&ssl, nullptr, 0);
+  if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    stop();
+    return 0;
+  }
+  return mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+bool TedapiClient::connected() {
+  available();
+  return open;
+}
+
+int TedapiClient::read(uint8_t* buf, size_t len) {
+  if (!available()) return -1;
+  int ret = mbedtls_ssl_read(&ssl, buf, len);
+  if (ret < 0) {
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) stop();
+    return -1;
+  }
+  return ret;
+}
+
+int TedapiClient::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+bool TedapiClient::pinMatches() {
+  const char* pin = TEDAPI_CERT_SHA256;
+  if (!pin[0]) return true;
+  const mbedtls_x509_crt* cert = mbedtls_ssl_get_peer_cert(&ssl);
+  if (!cert) return false;
+  unsigned char digest[32];
+  if (mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), cert->raw.p, cert->raw.len, digest) != 0) return false;
+  char hex[65];
+  for (size_t i = 0; i < sizeof(digest); i++) snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+  return strcasecmp(hex, pin) == 0;
+}
@@ -0,0 +1,60 @@
+#ifndef TEDAPI_CLIENT_H
+#define TEDAPI_CLIENT_H
+
+#include <Arduino.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include "deadline.h"
+
+// 1 = set up TLS with the gateway profile in tedapi_client.cpp, 0 = mbedTLS defaults
+#ifndef TEDAPI_TLS_TUNED
+#define TEDAPI_TLS_TUNED 1
+#endif
+// SHA-256 of the gateway certificate as 64 hex digits; empty accepts any certificate
+#ifndef TEDAPI_CERT_SHA256
+#define TEDAPI_CERT_SHA256 ""
+#endif
+
+// TLS client for the gateway. It owns its socket and mbedTLS session, so the cipher list, fragment
+// length and session reuse suit the gateway, and the handshake waits on the socket between steps.
+class TedapiClient {
+public:
+  TedapiClient();
+  ~TedapiClient();
+
+  // tuned: gateway profile, offering the session from the previous connection so the gateway can
+  // skip the key exchange; otherwise the mbedTLS defaults
+  bool connect(const char* host, uint16_t port, unsigned long timeoutMs, bool tuned = TEDAPI_TLS_TUNED);
+  void stop();
+  // False once the peer has closed or the session failed
+  bool connected();
+  // Decrypted bytes ready to read without blocking
+  int available();
+  int read();
+  int read(uint8_t* buf, size_t len);
+
+  int socketFd() const { return net.fd; }
+  mbedtls_net_context* netContext() { return &net; }
+  mbedtls_ssl_context* sslContext() { return open ? &ssl : nullptr; }
+  // Time the last connect() spent on the TCP connect, before the handshake started
+  uint32_t tcpConnectUs() const { return lastTcpConnectUs; }
+  void forgetSession();
+
+private:
+  bool openSocket(const char* host, uint16_t port, const Deadline& deadline);
+  bool pinMatches();
+
+  mbedtls_net_context net;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config conf;
+  mbedtls_ctr_drbg_context drbg;
+  mbedtls_entropy_context entropy;
+  mbedtls_ssl_session savedSession;
+  bool open = false;
+  bool haveSession = false;
+  uint32_t lastTcpConnectUs = 0;
+};
+
+#endif // TEDAPI_CLIENT_H
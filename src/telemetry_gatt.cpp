@@ -0,0 +1,122 @@
+#include "telemetry_gatt.h"
+
+static const char *TELEMETRY_SERVICE_UUID = "6b1e0001-5a5e-4f3c-9c31-7f2a4bd1e6a0";
+static const char *TELEMETRY_SAMPLE_UUID = "6b1e0002-5a5e-4f3c-9c31-7f2a4bd1e6a0";
+static const char *TELEMETRY_HISTORY_UUID = "6b1e0003-5a5e-4f3c-9c31-7f2a4bd1e6a0";
+
+TelemetryGatt::TelemetryGatt()
+  : server(nullptr), sampleChar(nullptr), historyChar(nullptr), history(nullptr),
+    requestedLevel(NO_REQUEST), requestedConn(0), dumping(false), dumpLevel(0), dumpStart(0),
+    dumpSeq(0), dumpEnd(0), chunkBytes(0), lastChunkMs(0) {}
+
+void TelemetryGatt::begin(const PowerHistory *historyArg) {
+  if (server) return;
+  history = historyArg;
+  NimBLEDevice::setMTU(TELEMETRY_GATT_MTU);
+  server = NimBLEDevice::createServer();
+  server->setCallbacks(this, false);
+  // The advertiser's tick() restarts advertising once a connection has stopped it
+  server->advertiseOnDisconnect(false);
+  NimBLEService *service = server->createService(TELEMETRY_SERVICE_UUID);
+  sampleChar = service->createCharacteristic(TELEMETRY_SAMPLE_UUID, NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY,
+                                             sizeof(TelemetrySample));
+  historyChar = service->createCharacteristic(TELEMETRY_HISTORY_UUID, NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::NOTIFY,
+                                              TELEMETRY_GATT_MTU - 3);
+  historyChar->setCallbacks(this);
+  service->start();
+  server->start();
+  Serial.println("[GATT] Telemetry service started");
+}
+
+static uint16_t clampU16(float v) {
+  if (!(v > 0)) return 0;
+  return v >= UINT16_MAX ? UINT16_MAX : (uint16_t)lroundf(v);
+}
+
+void TelemetryGatt::publish(const HomeAutomationData &ha, bool gatewayOnline) {
+  if (!sampleChar || !ha.valid) return;
+  TelemetrySample s;
+  s.updateMs = ha.last_update_ms;
+  s.gatewayTime = (uint32_t)(ha.gateway_time_ms / 1000);
+  s.solarW = (int32_t)lroundf(ha.solar_power_w);
+  s.loadW = (int32_t)lroundf(ha.load_power_w);
+  s.siteW = (int32_t)lroundf(ha.site_power_w);
+  s.batteryW = (int32_t)lroundf(ha.battery_power_w);
+  s.energyWh = ha.battery_wh_remaining > 0 ? (uint32_t)lroundf(ha.battery_wh_remaining) : 0;
+  s.socCenti = clampU16(ha.battery_percent * 100);
+  for (uint8_t i = 0; i < 3; i++) s.voltageDv[i] = clampU16(ha.grid_voltage_v[i] * 10);
+  s.flags = (ha.grid_connected ? 0x01 : 0) | (gatewayOnline ? 0x02 : 0);
+  s.alerts = ha.alert_count;
+  s.blockCount = ha.block_count;
+  for (uint8_t i = 0; i < MAX_BATTERY_BLOCKS; i++) {
+    float p = i < ha.block_count && ha.blocks[i].valid ? ha.blocks[i].battery_percent : 0;
+    s.blockPercent[i] = p < 0 ? 0 : (p > 100 ? 100 : (uint8_t)lroundf(p));
+  }
+  sampleChar->setValue((const uint8_t *)&s, sizeof(s));
+  // notify() without arguments sends a heap copy of the stored value
+  sampleChar->notify((const uint8_t *)&s, sizeof(s));
+}
+
+void TelemetryGatt::onConnect(NimBLEServer *, ble_gap_conn_desc *desc) {
+  Serial.printf("[GATT] Client connected (handle %u)\n", desc->conn_handle);
+}
+
+void TelemetryGatt::onDisconnect(NimBLEServer *, ble_gap_conn_desc *desc) {
+  Serial.printf("[GATT] Client disconnected (handle %u)\n", desc->conn_handle);
+  if (requestedConn == desc->conn_handle) requestedLevel = NO_REQUEST;
+}
+
+void TelemetryGatt::onWrite(NimBLECharacteristic *characteristic, ble_gap_conn_desc *desc) {
+  std::string value = characteristic->getValue();
+  if (value.size() != 1) return;
+  requestedConn = desc->conn_handle;
+  requestedLevel = (uint8_t)value[0];
+}
+
+void TelemetryGatt::tick() {
+  if (!server) return;
+  if (requestedLevel != NO_REQUEST) {
+    uint8_t level = requestedLevel;
+    requestedLevel = NO_REQUEST;
+    if (!history || level >= HISTORY_LEVELS) {
+      Serial.printf("[GATT] History level %u unavailable\n", level);
+      return;
+    }
+    // Chunks are sized for the requester; other subscribers see the same notifications
+    uint16_t payload = server->getPeerMTU(requestedConn) - 3;
+    if (payload > TELEMETRY_GATT_MTU - 3) payload = TELEMETRY_GATT_MTU - 3;
+    chunkBytes = CHUNK_HEADER + (payload - CHUNK_HEADER) / sizeof(HistoryBucket) * sizeof(HistoryBucket);
+    dumpLevel = level;
+    dumpEnd = history->total(level);
+    dumpStart = dumpSeq = dumpEnd > HISTORY_CAPACITY ? dumpEnd - HISTORY_CAPACITY : 0;
+    dumping = true;
+    lastChunkMs = millis() - TELEMETRY_GATT_CHUNK_INTERVAL_MS;
+  }
+  if (dumping && millis() - lastChunkMs >= TELEMETRY_GATT_CHUNK_INTERVAL_MS) {
+    lastChunkMs = millis();
+    streamHistory();
+  }
+}
+
+void TelemetryGatt::streamHistory() {
+#ifndef DISPLAY_HEADLESS
+  uint8_t chunk[TELEMETRY_GATT_MTU - 3];
+  uint16_t index = (uint16_t)(dumpSeq - dumpStart);
+  uint16_t len = CHUNK_HEADER;
+  // Buckets overwritten since the dump started are skipped; the index shows the gap
+  while (dumpSeq < dumpEnd && len + sizeof(HistoryBucket) <= chunkBytes) {
+    HistoryBucket b;
+    if (history->copy(dumpLevel, dumpSeq++, b)) {
+      memcpy(chunk + len, &b, sizeof(b));
+      len += sizeof(b);
+    } else if (len == CHUNK_HEADER) {
+      index++;
+    }
+  }
+  memcpy(chunk, &index, CHUNK_HEADER);
+  historyChar->notify(chunk, len);
+  if (len == CHUNK_HEADER) dumping = false;
+#else
+  dumping = false;
+#endif
+}
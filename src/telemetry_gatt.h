@@ -0,0 +1,82 @@
+#ifndef TELEMETRY_GATT_H
+#define TELEMETRY_GATT_H
+
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+#include "powerwall.h"
+#include "history.h"
+
+// Connectable GATT service next to the BTHome broadcaster, for clients that want every poll and
+// the stored history rather than whatever frame is on air. Off by default; build with
+// -DTELEMETRY_GATT=1 (the advertiser then switches to connectable advertising).
+#ifndef TELEMETRY_GATT
+#define TELEMETRY_GATT 0
+#endif
+#ifndef TELEMETRY_GATT_MTU
+#define TELEMETRY_GATT_MTU 185
+#endif
+// Spacing of history notifications, so a dump neither stalls the loop nor drains the host's buffers
+#ifndef TELEMETRY_GATT_CHUNK_INTERVAL_MS
+#define TELEMETRY_GATT_CHUNK_INTERVAL_MS 15
+#endif
+
+// Sample characteristic value, little-endian
+struct __attribute__((packed)) TelemetrySample {
+  uint32_t updateMs;        // millis() when the poll request went out
+  int32_t solarW;
+  int32_t loadW;
+  int32_t siteW;
+  int32_t batteryW;
+  uint32_t energyWh;        // energy remaining
+  uint16_t socCenti;        // battery percent in 0.01 % steps
+  uint16_t voltageDv[3];    // per phase, 0.1 V
+  uint8_t flags;            // bit 0 grid connected, bit 1 gateway online
+  uint8_t alerts;
+  uint8_t blockCount;
+  uint8_t blockPercent[MAX_BATTERY_BLOCKS];
+  uint32_t gatewayTime;     // Unix seconds from the gateway clock, 0 when unknown
+};
+
+static_assert(sizeof(HistoryBucket) == 18, "history buckets go on the wire as-is");
+
+// Sample (read/notify): the latest TelemetrySample, notified on every poll.
+// History (write/notify): write one byte with the history level to dump it oldest first. Each
+// notification is a uint16 index (buckets since the dump start) followed by as many
+// HistoryBucket records as the requesting client's MTU allows; an index without records ends
+// the dump. Needs the display build, which owns the history.
+class TelemetryGatt : public NimBLEServerCallbacks, public NimBLECharacteristicCallbacks {
+public:
+  TelemetryGatt();
+  // After NimBLEDevice::init(); history may be null
+  void begin(const PowerHistory *historyArg);
+  void publish(const HomeAutomationData &ha, bool gatewayOnline);
+  void tick();
+
+  void onConnect(NimBLEServer *server, ble_gap_conn_desc *desc) override;
+  void onDisconnect(NimBLEServer *server, ble_gap_conn_desc *desc) override;
+  void onWrite(NimBLECharacteristic *characteristic, ble_gap_conn_desc *desc) override;
+
+private:
+  static const uint8_t NO_REQUEST = 0xFF;
+  static const uint8_t CHUNK_HEADER = 2;
+
+  void streamHistory();
+
+  NimBLEServer *server;
+  NimBLECharacteristic *sampleChar;
+  NimBLECharacteristic *historyChar;
+  const PowerHistory *history;
+  // Set from the NimBLE host task, consumed by tick()
+  volatile uint8_t requestedLevel;
+  volatile uint16_t requestedConn;
+  // Dump in progress
+  bool dumping;
+  uint8_t dumpLevel;
+  uint32_t dumpStart;
+  uint32_t dumpSeq;
+  uint32_t dumpEnd;
+  uint16_t chunkBytes;
+  unsigned long lastChunkMs;
+};
+
+#endif // TELEMETRY_GATT_H
@@ -0,0 +1,9 @@
+#ifndef NATIVE_ESP_SYSTEM_H
+#define NATIVE_ESP_SYSTEM_H
+
+#include <cstdint>
+#include <cstdlib>
+
+inline uint32_t esp_random() { return (uint32_t)rand(); }
+
+#endif // NATIVE_ESP_SYSTEM_H
@@ -0,0 +1,59 @@
+#include <unity.h>
+#include "bthome_crypto.h"
+
+struct BTHomeVector {
+  uint8_t mac[6];
+  uint32_t counter;
+  uint8_t len;
+  uint8_t plain[18];
+  uint8_t sealed[18 + BTHOME_CRYPTO_OVERHEAD];
+};
+
+// Key, MAC, counter and first payload (temperature 25.06 C, humidity 50.55 %) are the BTHome v2
+// encryption example; the second payload is a power frame. Expected output from OpenSSL AES-CCM.
+static const uint8_t VECTOR_KEY[16] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1,
+                                       0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+static const BTHomeVector VECTORS[] = {
+  {{0x54, 0x48, 0xe6, 0x8f, 0x80, 0xa5}, 0x00112233, 6,
+   {0x02, 0xca, 0x09, 0x03, 0xbf, 0x13},
+   {0xe4, 0x45, 0xf3, 0xc9, 0x96, 0x2b, 0x33, 0x22, 0x11, 0x00, 0x6c, 0x7c, 0x45, 0x19}},
+  {{0x54, 0x48, 0xe6, 0x8f, 0x80, 0xa5}, 0x01020304, 18,
+   {0x0b, 0x98, 0x22, 0x04, 0x0b, 0xd8, 0xca, 0x02, 0x5c, 0x10, 0x5f, 0xff, 0xff, 0x5c, 0x68, 0x48, 0xff, 0xff},
+   {0x51, 0x39, 0xbe, 0x7f, 0x76, 0xa6, 0xd2, 0x72, 0x18, 0xf5, 0x8f, 0x2f, 0xc4, 0xfc, 0x5f, 0xb6, 0x2a, 0x30,
+    0x04, 0x03, 0x02, 0x01, 0x0c, 0xa9, 0xe3, 0x9c}},
+};
+
+static void test_seal_matches_vectors() {
+  for (const BTHomeVector& v : VECTORS) {
+    BTHomeCipher cipher;
+    uint8_t out[sizeof(v.sealed)];
+    TEST_ASSERT_TRUE(cipher.setKey(VECTOR_KEY, v.mac, v.counter));
+    TEST_ASSERT_EQUAL_UINT8(v.len + BTHOME_CRYPTO_OVERHEAD, cipher.seal(0x41, v.plain, v.len, out));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(v.sealed, out, v.len + BTHOME_CRYPTO_OVERHEAD);
+  }
+}
+
+static void test_counter_advances_per_frame() {
+  const BTHomeVector& v = VECTORS[0];
+  BTHomeCipher cipher;
+  uint8_t out[sizeof(v.sealed)];
+  TEST_ASSERT_TRUE(cipher.setKey(VECTOR_KEY, v.mac, v.counter - 1));
+  cipher.seal(0x41, v.plain, v.len, out);
+  cipher.seal(0x41, v.plain, v.len, out);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(v.sealed, out, v.len + BTHOME_CRYPTO_OVERHEAD);
+}
+
+static void test_begin_rejects_malformed_key() {
+  BTHomeCipher cipher;
+  TEST_ASSERT_FALSE(cipher.begin("231d39c1d7cc1ab1aee224cd096db9", VECTORS[0].mac));
+  TEST_ASSERT_FALSE(cipher.begin("231d39c1d7cc1ab1aee224cd096db9zz", VECTORS[0].mac));
+  TEST_ASSERT_FALSE(cipher.enabled());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_seal_matches_vectors);
+  RUN_TEST(test_counter_advances_per_frame);
+  RUN_TEST(test_begin_rejects_malformed_key);
+  return UNITY_END();
+}
@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+"""Local TEDAPI gateway stand-in for measuring compressed vs. identity responses.
+
+serve: HTTPS server answering /tedapi/din, /tedapi/v1 (config, firmware, status) and
+       /tedapi/device/<din>/v1 (ComponentsQuery) with synthetic protobuf responses shaped like the gateway's.
+       Honours Accept-Encoding (gzip, deflate), keep-alive and pipelined requests, and logs
+       bytes on the wire and time to serve for every response.
+bench: client that requests the status query repeatedly with and without Accept-Encoding
+       and prints bytes on the wire and latency for both.
+
+Point the firmware at it with build flags, e.g.
+  -DTEDAPI_HOST=\\"192.168.4.2\\" -DTEDAPI_PORT=8443
+"""
+
+import argparse
+import gzip
+import http.client
+import http.server
+import json
+import os
+import socketserver
+import ssl
+import statistics
+import subprocess
+import tempfile
+import time
+import zlib
+
+DIN = "1707000-11-J--TG0123456789AB"
+BLOCK_DINS = ["2012170-25-E--TG0123456789AC", "2012170-25-E--TG0123456789AD"]
+
+
+def varint(value):
+    out = bytearray()
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+    return bytes(out)
+
+
+def field(number, payload):
+    """Length-delimited protobuf field."""
+    return varint((number << 3) | 2) + varint(len(payload)) + payload
+
+
+def controller_json(seed):
+    meters = [
+        {"location": "SITE", "realPowerW": -412.0 + seed},
+        {"location": "LOAD", "realPowerW": 1830.0},
+        {"location": "SOLAR", "realPowerW": 2710.0 - seed},
+        {"location": "BATTERY", "realPowerW": -470.0},
+    ]
+    pods = [{"POD_EnergyStatus": {"isMIA": False, "POD_nom_energy_remaining": 9800 + i,
+                                  "POD_nom_full_pack_energy": 13500}} for i in range(8)]
+    pinvs = [{"PINV_Status": {"isMIA": False, "PINV_Pout": -0.235 - 0.01 * i}} for i in range(8)]
+    readings = [{"serial": "VAH4810AB%04d" % i,
+                 "dataRead": [{"voltageV": 121.4, "realPowerW": 300.5 + i, "reactivePowerVAR": -12.3,
+                               "currentA": 2.5} for _ in range(4)],
+                 "timestamp": "2024-05-01T12:00:00Z"} for i in range(24)]
+    doc = {
+        "control": {
+            "systemStatus": {"nominalFullPackEnergyWh": 27000, "nominalEnergyRemainingWh": 19650 - seed},
+            "islanding": {"customerIslandMode": "SELF_CONSUMPTION", "contactorClosed": True,
+                          "microGridOK": True, "gridOK": True},
+            "meterAggregates": meters,
+            "alerts": {"active": []},
+            "siteShutdown": {"isShutDown": False, "reasons": []},
+            "batteryBlocks": [{"din": d, "disableReasons": None} for d in BLOCK_DINS],
+            "pvInverters": [],
+        },
+        "neurio": {"isDetectingWiredMeters": False, "readings": readings},
+        "esCan": {"bus": {"POD": pods, "PINV": pinvs}},
+    }
+    return json.dumps(doc, indent=2).encode()
+
+
+def components_json(block, seed):
+    def signals(values):
+        return [{"name": name, "value": value, "textValue": None, "boolValue": None,
+                 "timestamp": "2024-05-01T12:00:00Z"} for name, value in values]
+    doc = {
+        "pw3Can": {"firmwareUpdate": {"isUpdating": False, "progress": None}},
+        "components": {
+            "pws": [],
+            "pch": [{"signals": signals([("PCH_BatteryPower", -235.0 - 10 * block + seed)]), "activeAlerts": []}],
+            "bms": [{"signals": signals([("BMS_nominalEnergyRemaining", 9.8 - 0.4 * block - seed / 1000.0),
+                                         ("BMS_nominalFullPackEnergy", 13.5)]), "activeAlerts": []}],
+            "hvp": [],
+            "baggr": [],
+        },
+    }
+    return json.dumps(doc, indent=2).encode()
+
+
+def recv_text_message(text):
+    # Message{ envelope(1){ payload(16){ recv(2){ value(1)=1, text(2) } } } }
+    payload_string = b"\x08\x01" + field(2, text)
+    query_type = field(2, payload_string)
+    envelope = b"\x08\x01" + field(16, query_type)
+    return field(1, envelope)
+
+
+def config_message():
+    config = {"vin": DIN, "battery_blocks": [{"vin": d, "type": "Powerwall3"} for d in BLOCK_DINS]}
+    recv = field(1, field(2, json.dumps(config).encode())) + field(2, os.urandom(32))
+    envelope = b"\x08\x01" + field(15, field(2, recv))
+    return field(1, envelope)
+
+
+def encode(body, accept, mode, wbits):
+    accept = accept.lower()
+    if mode == "identity":
+        return body, None
+    if mode in ("gzip", "auto") and ("gzip" in accept or mode == "gzip"):
+        return gzip.compress(body, compresslevel=9), "gzip"
+    if mode in ("deflate", "auto") and ("deflate" in accept or mode == "deflate"):
+        comp = zlib.compressobj(9, zlib.DEFLATED, wbits)
+        return comp.compress(body) + comp.flush(), "deflate"
+    return body, None
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    counter = 0
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def _send(self, body, content_type):
+        started = time.perf_counter()
+        wire, encoding = encode(body, self.headers.get("Accept-Encoding", ""), self.server.encoding, self.server.wbits)
+        self.send_response(200)
+        self.send_header("Content-Type", content_type)
+        if encoding:
+            self.send_header("Content-Encoding", encoding)
+        if self.server.chunked:
+            self.send_header("Transfer-Encoding", "chunked")
+        else:
+            self.send_header("Content-Length", str(len(wire)))
+        if self.headers.get("Connection", "").lower() == "close":
+            self.send_header("Connection", "close")
+            self.close_connection = True
+        self.end_headers()
+        if self.server.chunked:
+            for i in range(0, len(wire), 1400):
+                part = wire[i:i + 1400]
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(part), part))
+            self.wfile.write(b"0\r\n\r\n")
+        else:
+            self.wfile.write(wire)
+        self.wfile.flush()
+        elapsed = (time.perf_counter() - started) * 1000
+        print("%-40s %-8s raw=%6d wire=%6d (%4.1f%%) %.1f ms" % (
+            self.path, encoding or "identity", len(body), len(wire), 100.0 * len(wire) / max(1, len(body)), elapsed))
+
+    def do_GET(self):
+        if self.path == "/tedapi/din":
+            self._send(DIN.encode(), "text/plain")
+        else:
+            self.send_error(404)
+
+    def do_POST(self):
+        length = int(self.headers.get("Content-Length", "0"))
+        request = self.rfile.read(length)
+        Handler.counter += 1
+        if self.path.startswith("/tedapi/device/"):
+            block_din = self.path.split("/")[3]
+            if block_din not in BLOCK_DINS:
+                self.send_error(404)
+            elif b"query ComponentsQuery" in request:
+                self._send(recv_text_message(components_json(BLOCK_DINS.index(block_din), Handler.counter % 50)),
+                           "application/octet-stream")
+            else:
+                # The per-device endpoint only answers component queries
+                self._send(field(1, b"\x08\x01"), "application/octet-stream")
+        elif self.path != "/tedapi/v1":
+            self.send_error(404)
+        elif b"config.json" in request:
+            self._send(config_message(), "application/octet-stream")
+        elif b"query DeviceControllerQuery" in request:
+            self._send(recv_text_message(controller_json(Handler.counter % 50)), "application/octet-stream")
+        else:
+            self._send(field(1, b"\x08\x01"), "application/octet-stream")
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+def self_signed(directory):
+    cert = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "30",
+                    "-subj", "/CN=tedapi-stub", "-keyout", key, "-out", cert],
+                   check=True, capture_output=True)
+    return cert, key
+
+
+def serve(args):
+    tmp = tempfile.TemporaryDirectory()
+    cert, key = (args.cert, args.key) if args.cert else self_signed(tmp.name)
+    server = Server((args.bind, args.port), Handler)
+    server.encoding = args.encoding
+    server.wbits = args.wbits
+    server.chunked = args.chunked
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(cert, key)
+    server.socket = context.wrap_socket(server.socket, server_side=True)
+    print("TEDAPI stand-in on https://%s:%d (encoding=%s)" % (args.bind, args.port, args.encoding))
+    server.serve_forever()
+
+
+def bench(args):
+    context = ssl._create_unverified_context()
+    query = b"query DeviceControllerQuery " + os.urandom(16)
+    for accept in ("identity", "gzip, deflate"):
+        sizes, times = [], []
+        conn = http.client.HTTPSConnection(args.host, args.port, context=context)
+        for _ in range(args.count):
+            started = time.perf_counter()
+            conn.request("POST", "/tedapi/v1", body=query, headers={
+                "Content-Type": "application/octet-stream", "Accept-Encoding": accept, "Connection": "keep-alive"})
+            response = conn.getresponse()
+            body = response.read()
+            times.append((time.perf_counter() - started) * 1000)
+            sizes.append(len(body) + sum(len(k) + len(v) + 4 for k, v in response.getheaders()))
+            if response.getheader("Content-Encoding") == "gzip":
+                gzip.decompress(body)
+        conn.close()
+        print("%-14s bytes on wire %6d  latency median %.1f ms  p95 %.1f ms" % (
+            accept, statistics.median(sizes), statistics.median(times),
+            sorted(times)[max(0, int(len(times) * 0.95) - 1)]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+    s = sub.add_parser("serve")
+    s.add_argument("--bind", default="0.0.0.0")
+    s.add_argument("--port", type=int, default=8443)
+    s.add_argument("--cert")
+    s.add_argument("--key")
+    s.add_argument("--encoding", choices=["auto", "identity", "gzip", "deflate"], default="auto",
+                   help="auto follows Accept-Encoding; the others force that encoding")
+    s.add_argument("--wbits", type=int, default=15, help="zlib window bits for deflate (9-15, negative for raw)")
+    s.add_argument("--chunked", action="store_true", help="use Transfer-Encoding: chunked")
+    b = sub.add_parser("bench")
+    b.add_argument("--host", default="127.0.0.1")
+    b.add_argument("--port", type=int, default=8443)
+    b.add_argument("--count", type=int, default=20)
+    args = parser.parse_args()
+    serve(args) if args.command == "serve" else bench(args)
+
+
+if __name__ == "__main__":
+    main()